@@ -0,0 +1,76 @@
+// echo_server的建连压测：多个线程各自循环执行 connect -> 发送1字节 -> 收到echo -> close，
+// 统计每秒完成的连接数。close前设置SO_LINGER为0直接发送RST，避免客户端端口耗尽在TIME_WAIT上
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+std::atomic<bool> g_stop{false};
+
+uint64_t Worker(const sockaddr_in& addr, uint64_t& failures) {
+  auto done = (uint64_t)0;
+  while (!g_stop.load(std::memory_order_relaxed)) {
+    auto fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (fd < 0) {
+      perror("socket");
+      exit(EXIT_FAILURE);
+    }
+    auto one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    auto ok = false;
+    if (connect(fd, (const sockaddr*)&addr, sizeof(addr)) == 0) {
+      char c = 'x';
+      ok = write(fd, &c, 1) == 1 && read(fd, &c, 1) == 1;
+    }
+    auto lg = linger{.l_onoff = 1, .l_linger = 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    (void)close(fd);
+    ok ? done++ : failures++;
+  }
+  return done;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3 || argc > 5) {
+    std::cerr << "Usage: " << argv[0] << " host port [threads] [seconds]\n";
+    return -1;
+  }
+  auto addr = sockaddr_in{.sin_family = AF_INET, .sin_port = htons((uint16_t)atoi(argv[2]))};
+  if (inet_pton(AF_INET, argv[1], &addr.sin_addr) != 1) {
+    std::cerr << "invalid address: " << argv[1] << '\n';
+    return -1;
+  }
+  auto nthreads = argc > 3 ? atoi(argv[3]) : 8;
+  auto seconds = argc > 4 ? atoi(argv[4]) : 5;
+
+  auto results = std::vector<uint64_t>(nthreads);
+  auto failures = std::vector<uint64_t>(nthreads);
+  auto threads = std::vector<std::thread>{};
+  auto start = std::chrono::steady_clock::now();
+  for (auto i = 0; i < nthreads; i++) {
+    threads.emplace_back([&, i]() { results[i] = Worker(addr, failures[i]); });
+  }
+  std::this_thread::sleep_for(std::chrono::seconds(seconds));
+  g_stop = true;
+  for (auto& t : threads) {
+    t.join();
+  }
+  auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  auto total = (uint64_t)0;
+  auto failed = (uint64_t)0;
+  for (auto i = 0; i < nthreads; i++) {
+    total += results[i];
+    failed += failures[i];
+  }
+  std::cout << nthreads << " thread(s), " << total << " connection(s) in " << elapsed << "s: "
+            << (uint64_t)(total / elapsed) << " conn/s, " << failed << " failed\n";
+  return 0;
+}
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <condition_variable>
 #include <optional>
 #include <queue>
@@ -12,8 +14,13 @@ public:
 
   void emplace(auto&&... args);
 
+  // Non-blocking put, returns false if the queue is full
+  bool offer(T e);
+
   // Block until 
   T take();
+
+  size_t size() const;
   
 private:
   const size_t cap_;
@@ -41,6 +48,18 @@ inline void BlockingQueue<T>::emplace(auto&&... args) {
   not_empty_.notify_one();
 }
 
+template <class T>
+inline bool BlockingQueue<T>::offer(T e) {
+  std::unique_lock l(mtx_);
+  if (queue_.size() >= cap_) {
+    return false;
+  }
+  queue_.emplace(std::move(e));
+  l.unlock();
+  not_empty_.notify_one();
+  return true;
+}
+
 template <class T>
 inline T BlockingQueue<T>::take() {
   std::unique_lock l(mtx_);
@@ -52,3 +71,8 @@ inline T BlockingQueue<T>::take() {
   return r;
 }
 
+template <class T>
+inline size_t BlockingQueue<T>::size() const {
+  std::lock_guard l(mtx_);
+  return queue_.size();
+}
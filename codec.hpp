@@ -0,0 +1,110 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include <endian.h>
+#include <sys/types.h>
+
+// Message framing for byte streams. A codec splits the bytes read from a
+// connection into frames and encodes responses back into the same format:
+//
+//   auto consumed = codec.Decode(buf, [&](std::string_view frame) { ... });
+//
+// Decode() hands every complete frame at the front of buf to the callback as
+// a view into buf (no copy) and returns how many bytes it consumed; the rest
+// is a partial frame the caller keeps for the next read. It returns -1 if a
+// frame is larger than max_frame, the connection should then be closed.
+// Encode() appends one framed payload to an output buffer, so the responses to
+// a whole batch of requests can go out with a single write.
+
+// 4-byte big-endian payload length followed by the payload
+class LengthPrefixedCodec {
+public:
+  static constexpr size_t kHeaderSize = 4;
+
+  explicit LengthPrefixedCodec(size_t max_frame = 1 << 20) : max_frame_{max_frame} {}
+
+  template <class Fn>
+  ssize_t Decode(std::string_view buf, Fn&& on_frame);
+
+  void Encode(std::string& out, std::string_view payload) const;
+
+private:
+  size_t max_frame_;
+};
+
+// Payload terminated by a delimiter byte, e.g. '\n' for line based protocols.
+// The delimiter is not part of the frame.
+class DelimitedCodec {
+public:
+  explicit DelimitedCodec(char delimiter = '\n', size_t max_frame = 1 << 20)
+    : delimiter_{delimiter}, max_frame_{max_frame} {}
+
+  template <class Fn>
+  ssize_t Decode(std::string_view buf, Fn&& on_frame);
+
+  void Encode(std::string& out, std::string_view payload) const;
+
+private:
+  char delimiter_;
+  size_t max_frame_;
+  // Length of the partial frame left by the last Decode(), known not to
+  // contain the delimiter, so a large frame arriving in pieces is scanned once
+  size_t scanned_{0};
+};
+
+template <class Fn>
+ssize_t LengthPrefixedCodec::Decode(std::string_view buf, Fn&& on_frame) {
+  auto pos = (size_t)0;
+  while (buf.size() - pos >= kHeaderSize) {
+    auto len = (uint32_t)0;
+    std::memcpy(&len, buf.data() + pos, kHeaderSize);
+    len = be32toh(len);
+    if (len > max_frame_) {
+      return -1;
+    }
+    if (buf.size() - pos - kHeaderSize < len) {
+      break;
+    }
+    on_frame(buf.substr(pos + kHeaderSize, len));
+    pos += kHeaderSize + len;
+  }
+  return pos;
+}
+
+inline void LengthPrefixedCodec::Encode(std::string& out, std::string_view payload) const {
+  auto len = htobe32((uint32_t)payload.size());
+  out.append((const char*)&len, kHeaderSize);
+  out.append(payload);
+}
+
+template <class Fn>
+ssize_t DelimitedCodec::Decode(std::string_view buf, Fn&& on_frame) {
+  auto pos = (size_t)0;
+  auto from = std::min(scanned_, buf.size());
+  while (from < buf.size()) {
+    auto p = (const char*)std::memchr(buf.data() + from, delimiter_, buf.size() - from);
+    if (p == nullptr) {
+      break;
+    }
+    auto end = (size_t)(p - buf.data());
+    if (end - pos > max_frame_) {
+      return -1;
+    }
+    on_frame(buf.substr(pos, end - pos));
+    pos = from = end + 1;
+  }
+  scanned_ = buf.size() - pos;
+  if (scanned_ > max_frame_) {
+    return -1;
+  }
+  return pos;
+}
+
+inline void DelimitedCodec::Encode(std::string& out, std::string_view payload) const {
+  out.append(payload);
+  out.push_back(delimiter_);
+}
@@ -0,0 +1,136 @@
+// echo_server -f len|line的pipeline压测：一个连接上每次连续发送depth个请求(一次write)，
+// 收齐depth个回复后再发下一批，统计depth为1到128时每秒处理的消息数。
+// 服务端每一批请求只需要一次唤醒，depth越大每个消息分摊的系统调用越少。
+// 最后的flood阶段一直发送请求，同时另一个线程慢慢读回复，服务端写阻塞时请求还在不断到达
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+#include "codec.hpp"
+
+bool WriteAll(int fd, const std::string& buf) {
+  auto written = (size_t)0;
+  while (written < buf.size()) {
+    auto r = write(fd, buf.data() + written, buf.size() - written);
+    if (r <= 0) {
+      return false;
+    }
+    written += r;
+  }
+  return true;
+}
+
+bool ReadAll(int fd, std::string& buf, size_t len) {
+  buf.resize(len);
+  auto got = (size_t)0;
+  while (got < len) {
+    auto r = read(fd, buf.data() + got, len - got);
+    if (r <= 0) {
+      return false;
+    }
+    got += r;
+  }
+  return true;
+}
+
+// 一个线程不停地发送batch，另一个线程每读64KB休眠1ms。返回收到的回复字节数，连接被关闭时返回0
+size_t Flood(int fd, const std::string& batch, double seconds) {
+  auto sent = (size_t)0;
+  auto received = std::atomic<size_t>{0};
+  auto reader = std::thread([&]() {
+    char buf[65536];
+    while (true) {
+      auto r = read(fd, buf, sizeof(buf));
+      if (r <= 0) {
+        break;
+      }
+      received += r;
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  });
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(seconds);
+  while (std::chrono::steady_clock::now() < deadline && WriteAll(fd, batch)) {
+    sent += batch.size();
+  }
+  // 回复收齐后服务端读到EOF，关闭连接，reader线程退出
+  (void)shutdown(fd, SHUT_WR);
+  reader.join();
+  return received == sent ? sent : 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 4 || argc > 6) {
+    std::cerr << "Usage: " << argv[0] << " host port len|line [payload_bytes] [seconds_per_depth]\n";
+    return -1;
+  }
+  auto addr = sockaddr_in{.sin_family = AF_INET, .sin_port = htons((uint16_t)atoi(argv[2]))};
+  if (inet_pton(AF_INET, argv[1], &addr.sin_addr) != 1) {
+    std::cerr << "invalid address: " << argv[1] << '\n';
+    return -1;
+  }
+  auto line = strcmp(argv[3], "line") == 0;
+  if (!line && strcmp(argv[3], "len") != 0) {
+    std::cerr << "unknown framing: " << argv[3] << '\n';
+    return -1;
+  }
+  auto payload = std::string(argc > 4 ? atoi(argv[4]) : 32, 'x');
+  auto seconds = argc > 5 ? atof(argv[5]) : 1.0;
+
+  auto fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (fd < 0 || connect(fd, (const sockaddr*)&addr, sizeof(addr)) != 0) {
+    perror("connect");
+    return -1;
+  }
+  auto one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  auto response = std::string{};
+  for (auto depth = 1; depth <= 128; depth *= 2) {
+    // 回显服务的回复和请求字节完全相同
+    auto batch = std::string{};
+    for (auto i = 0; i < depth; i++) {
+      line ? DelimitedCodec{}.Encode(batch, payload) : LengthPrefixedCodec{}.Encode(batch, payload);
+    }
+    auto batches = (uint64_t)0;
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::duration<double>(seconds);
+    while (std::chrono::steady_clock::now() < deadline) {
+      if (!WriteAll(fd, batch) || !ReadAll(fd, response, batch.size())) {
+        std::cerr << "connection closed by server\n";
+        return -1;
+      }
+      if (batches++ == 0 && response != batch) {
+        std::cerr << "unexpected response at depth " << depth << '\n';
+        return -1;
+      }
+    }
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "depth " << depth << ": " << (uint64_t)(batches * depth / elapsed) << " msg/s, "
+              << (uint64_t)(batches / elapsed) << " batch/s\n";
+  }
+
+  auto batch = std::string{};
+  for (auto i = 0; i < 128; i++) {
+    line ? DelimitedCodec{}.Encode(batch, payload) : LengthPrefixedCodec{}.Encode(batch, payload);
+  }
+  auto start = std::chrono::steady_clock::now();
+  auto echoed = Flood(fd, batch, seconds);
+  if (echoed == 0) {
+    std::cerr << "flood: connection closed by server before all replies arrived\n";
+    return -1;
+  }
+  auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::cout << "flood: " << (uint64_t)(echoed / batch.size() * 128 / elapsed)
+            << " msg/s with a slow reader\n";
+  (void)close(fd);
+  return 0;
+}
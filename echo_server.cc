@@ -1,20 +1,31 @@
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <coroutine>
 #include <iostream>
 #include <memory>
+#include <sstream>
 #include <string>
 #include <unordered_map>
+#include <utility>
 
 #include <arpa/inet.h>
 #include <errno.h>
 #include <sys/epoll.h>
+#include <signal.h>
+#include <sys/signalfd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/ip.h>
 #include <unistd.h>
 #include <fcntl.h>
 
+#include "codec.hpp"
+#include "metrics.hpp"
+#include "offload.hpp"
+#include "ring_buffer.hpp"
+#include "trace.hpp"
+
 
 struct promise_type;
 
@@ -24,14 +35,173 @@ struct Coroutine : public CoroutineHandle {
   using promise_type = ::promise_type;
 };
 
+// 连接协程的前两个参数都是(epfd, fd)。协程结束后frame立即销毁(final_suspend不挂起)，
+// 析构promise时把连接从g_registry中移除
 struct promise_type {
+  template <class... Args>
+  promise_type(int epfd, int fd, const Args&...);
+  ~promise_type();
+  // 统计协程frame占用的堆内存
+  static void* operator new(size_t size);
+  static void operator delete(void* ptr, size_t size);
   Coroutine get_return_object() { return (Coroutine)CoroutineHandle::from_promise(*this); }
-  std::suspend_always initial_suspend() noexcept { return {}; }
-  std::suspend_always final_suspend() noexcept { return {}; }
+  // 创建后先挂起，第一次被resume时在trace中开始running
+  struct InitialAwaiter : std::suspend_always {
+    uint64_t id;
+    int fd;
+    void await_resume() const noexcept { TRACE_RESUME_FD(kStart, id, fd); }
+  };
+  InitialAwaiter initial_suspend() noexcept { return {{}, id, fd}; }
+  std::suspend_never final_suspend() noexcept { return {}; }
   void return_void() {}
   void unhandled_exception() {}
+
+  int fd;
+  // 协程编号，不会像fd和frame地址那样被复用，trace中每个协程一行
+  uint64_t id;
+  static inline uint64_t next_id = 0;
+  // frame的大小。operator new把它记在allocated_frame_bytes里，由紧接着构造的promise取走
+  size_t frame_bytes;
+  static inline size_t allocated_frame_bytes = 0;
+};
+
+// 持有所有连接协程的handle，统计每个连接占用的内存(协程frame加上读写缓冲区)，
+// 并且支持关闭服务时统一drain或者强制销毁所有连接
+class ConnectionRegistry {
+public:
+  enum class Kind {
+    kConnection, // 业务连接
+    kPeer, // 同一个业务连接的另一个协程(全双工模式的writer)，内存算在连接上，不单独计数
+    kAdmin, // 管理端口的连接，不算业务连接
+  };
+
+  void Add(int fd, CoroutineHandle handle, Kind kind);
+
+  void Remove(int fd);
+
+  // 连接fd的缓冲区占用了bytes字节
+  void SetBufferBytes(int fd, size_t bytes);
+
+  void AddFrameBytes(ssize_t delta) { metrics::Local().frame_bytes.Add(delta); }
+
+  // 所有协程，包括管理连接
+  size_t size() const { return entries_.size(); }
+
+  size_t connections() const { return connections_; }
+
+  size_t MemoryPerConnection() const {
+    return connections_ == 0 ? 0 : connection_bytes_ / connections_;
+  }
+
+  // 关闭所有连接的读端：连接协程读到EOF，写完已经收到的数据后自行退出
+  void Drain();
+
+  // 立即关闭所有连接并销毁它们的协程
+  void Destroy(int epfd);
+
+private:
+  struct Entry {
+    CoroutineHandle handle;
+    Kind kind;
+    size_t buffer_bytes{0};
+  };
+
+  // 业务连接(kConnection和kPeer)的内存变化
+  void AddConnectionBytes(const Entry& entry, ssize_t delta);
+
+  std::unordered_map<int, Entry> entries_;
+  size_t connections_{0};
+  size_t connection_bytes_{0};
 };
 
+inline void ConnectionRegistry::Add(int fd, CoroutineHandle handle, Kind kind) {
+  auto& entry = entries_[fd] = Entry{.handle = handle, .kind = kind};
+  connections_ += kind == Kind::kConnection;
+  AddConnectionBytes(entry, handle.promise().frame_bytes);
+}
+
+inline void ConnectionRegistry::Remove(int fd) {
+  auto it = entries_.find(fd);
+  if (it == entries_.end()) {
+    return;
+  }
+  SetBufferBytes(fd, 0);
+  connections_ -= it->second.kind == Kind::kConnection;
+  AddConnectionBytes(it->second, -(ssize_t)it->second.handle.promise().frame_bytes);
+  entries_.erase(it);
+}
+
+inline void ConnectionRegistry::SetBufferBytes(int fd, size_t bytes) {
+  auto& entry = entries_.at(fd);
+  auto delta = (ssize_t)bytes - (ssize_t)entry.buffer_bytes;
+  entry.buffer_bytes = bytes;
+  AddConnectionBytes(entry, delta);
+  metrics::Local().connection_buffer_bytes.Add(delta);
+}
+
+inline void ConnectionRegistry::AddConnectionBytes(const Entry& entry, ssize_t delta) {
+  if (entry.kind != Kind::kAdmin) {
+    connection_bytes_ += delta;
+    metrics::Local().connection_memory_bytes.Add(delta);
+  }
+}
+
+inline void ConnectionRegistry::Drain() {
+  for (auto& [fd, entry] : entries_) {
+    (void)shutdown(fd, SHUT_RD);
+  }
+}
+
+inline void ConnectionRegistry::Destroy(int epfd) {
+  // 销毁协程时promise的析构函数会调用Remove()
+  auto entries = entries_;
+  for (auto& [fd, entry] : entries) {
+    (void)epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+    (void)close(fd);
+    entry.handle.destroy();
+  }
+}
+
+auto g_registry = ConnectionRegistry{};
+
+// 执行阻塞调用的线程池(-o)。协程co_await Offload(*g_offload_pool, *g_completions, fn)，
+// fn在worker线程上执行，完成后协程经由g_completions回到reactor线程继续执行。
+// g_completions在g_offload_pool之前定义：析构时线程池先执行完队列里的任务，这些任务还会Post
+auto g_completions = std::unique_ptr<CompletionQueue>{};
+auto g_offload_pool = std::unique_ptr<OffloadPool>{};
+
+// 强制销毁所有连接。先停掉线程池，这样不会有worker再访问即将销毁的协程frame
+void DestroyConnections(int epfd) {
+  g_offload_pool.reset();
+  g_registry.Destroy(epfd);
+}
+
+template <class... Args>
+inline promise_type::promise_type(int /*epfd*/, int fd, const Args&...)
+  : fd{fd}, id{++next_id}, frame_bytes{allocated_frame_bytes} {
+  metrics::Local().live_coroutines.Add(1);
+}
+
+inline promise_type::~promise_type() {
+  // 正常结束和被Destroy()销毁都经过这里
+  TRACE_SUSPEND_FD(kExit, id, fd);
+  metrics::Local().live_coroutines.Add(-1);
+  g_registry.Remove(fd);
+}
+
+// operator new不内联：g++内联后会把其中的全局operator new和这里的operator delete配对，
+// 误报-Wmismatched-new-delete
+[[gnu::noinline]] void* promise_type::operator new(size_t size) {
+  g_registry.AddFrameBytes(size);
+  allocated_frame_bytes = size;
+  return ::operator new(size);
+}
+
+inline void promise_type::operator delete(void* ptr, size_t size) {
+  g_registry.AddFrameBytes(-(ssize_t)size);
+  ::operator delete(ptr, size);
+}
+
 void setsockopt_i(int fd, int level, int optname, int value) {
   if (auto r = setsockopt(fd, level, optname, &value, 4); r != 0) {
     perror("setsockopt");
@@ -46,26 +216,37 @@ void epoll_ctl_ex(int epfd, int op, int fd, epoll_event* event) {
   }
 }
 
-void setnonblock(int fd) {
-  auto flags = fcntl(fd, F_GETFL, 0);
-  if (flags == -1) {
-    perror("fcntl");
-    exit(EXIT_FAILURE);
+// 准入控制：连接数或者尚未写回的字节数达到上限后，暂停accept(把listen fd从epoll中移除)
+// 或者(shed模式)接受后立即关闭新连接，已有连接不受影响；降到低水位(上限的90%)以下再恢复accept
+struct Admission {
+  size_t max_connections{0}; // 0表示不限制
+  size_t max_buffered_bytes{0}; // 0表示不限制
+  bool shed{false};
+  // 每次listen fd可读时最多accept的连接数
+  int accept_budget{64};
+  size_t connections{0};
+  size_t buffered_bytes{0};
+  bool paused{false};
+  // 预留的fd，accept遇到EMFILE/ENFILE时释放它来接受并关闭一个连接，避免listen fd一直可读
+  int reserve_fd{-1};
+
+  bool Overloaded() const {
+    return (max_connections && connections >= max_connections) ||
+           (max_buffered_bytes && buffered_bytes >= max_buffered_bytes);
   }
-  if (auto r = fcntl(fd, F_SETFL, flags | O_NONBLOCK); r == -1) {
-    perror("fcntl");
-    exit(EXIT_FAILURE);
+
+  bool BelowLowWater() const {
+    return (!max_connections || connections < max_connections - max_connections / 10) &&
+           (!max_buffered_bytes || buffered_bytes < max_buffered_bytes - max_buffered_bytes / 10);
   }
-}
 
-auto ToString(const sockaddr_in& addr) -> std::string {
-  char buff[INET_ADDRSTRLEN + 1];
-  if (!inet_ntop(AF_INET, &addr, buff, sizeof(addr))) {
-    perror("inet_ntop");
-    exit(EXIT_FAILURE);
+  void AddBuffered(ssize_t delta) {
+    buffered_bytes += delta;
+    metrics::Local().buffered_bytes.Add(delta);
   }
-  return buff;
-}
+};
+
+auto g_admission = Admission{};
 
 struct ReadAwaiter {
   bool ready;
@@ -73,6 +254,8 @@ struct ReadAwaiter {
   int fd;
   char* buf;
   size_t len;
+  uint64_t coroutine_id;
+  metrics::Clock::time_point suspended_at;
 
   static ReadAwaiter Ready(int fd, int ret) {
     return {.ready = true, .ret = ret, .fd = fd};
@@ -84,13 +267,18 @@ struct ReadAwaiter {
 
   bool await_ready() const noexcept { return ready; }
 
-  void await_suspend(std::coroutine_handle<> handle) {
+  void await_suspend(CoroutineHandle handle) {
     assert(!ready);
     std::cout << "[" << fd << "] suspended by read\n";
+    suspended_at = metrics::OnSuspend(metrics::Reason::kRead);
+    coroutine_id = handle.promise().id;
+    TRACE_SUSPEND_FD(kRead, coroutine_id, fd);
   }
 
   ssize_t await_resume() {
     if (!ready) {
+      metrics::OnResume(suspended_at);
+      TRACE_RESUME_FD(kRead, coroutine_id, fd);
       std::cout << "[" << fd << "] resumed from read\n";
       ret = read(fd, buf, len);
     }
@@ -105,6 +293,8 @@ ReadAwaiter Read(int fd, char* buf, size_t len) {
   return ready ? ReadAwaiter::Ready(fd, ret) : ReadAwaiter::Suspend(fd, buf, len);
 }
 
+// 等待写时fd只关注EPOLLOUT，恢复后换回idle_events。idle_events为0表示fd平时不在epoll中：
+// 挂起时ADD，恢复时DEL
 struct WriteAwaiter {
   bool ready;
   ssize_t ret;
@@ -112,38 +302,52 @@ struct WriteAwaiter {
   int sockfd;
   const char* buf;
   size_t len;
+  uint32_t idle_events;
   void* handle_address;
+  uint64_t coroutine_id;
+  metrics::Clock::time_point suspended_at;
 
   static WriteAwaiter Ready(int sockfd, ssize_t ret) {
     return WriteAwaiter{.ready = true, .ret = ret, .sockfd = sockfd};
   }
 
-  static WriteAwaiter Suspend(int epfd, int sockfd, const char* buf, size_t len) {
-    return WriteAwaiter{.ready = false, .epfd = epfd, .sockfd=sockfd, .buf = buf, .len = len};
+  static WriteAwaiter Suspend(int epfd, int sockfd, const char* buf, size_t len, uint32_t idle_events) {
+    return WriteAwaiter{.ready = false, .epfd = epfd, .sockfd=sockfd, .buf = buf, .len = len,
+                        .idle_events = idle_events};
   }
 
   bool await_ready() const noexcept { return ready; }
 
-  void await_suspend(std::coroutine_handle<> handle) {
+  void await_suspend(CoroutineHandle handle) {
     assert(!ready);
     std::cout << "[" << sockfd << "] suspended by write\n";
+    suspended_at = metrics::OnSuspend(metrics::Reason::kWrite);
     handle_address = handle.address();
-    // add EPOLLOUT and pass the coroutine handle to epoll
+    coroutine_id = handle.promise().id;
+    TRACE_SUSPEND_FD(kWrite, coroutine_id, sockfd);
+    // wait for EPOLLOUT only, otherwise incoming data would resume the writer
+    // before the socket is writable and the retried write() fails with EAGAIN
     auto ev = epoll_event{};
-    ev.events = EPOLLIN | EPOLLOUT;
+    ev.events = EPOLLOUT;
     ev.data.ptr = handle.address();
-    epoll_ctl_ex(epfd, EPOLL_CTL_MOD, sockfd, &ev);
+    epoll_ctl_ex(epfd, idle_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, sockfd, &ev);
   }
 
   ssize_t await_resume() {
     if (!ready) {
       assert(handle_address);
+      metrics::OnResume(suspended_at);
+      TRACE_RESUME_FD(kWrite, coroutine_id, sockfd);
       std::cout << "[" << sockfd << "] resumed from write\n";
-      // remove EPOLLOUT
-      auto ev = epoll_event{};
-      ev.events = EPOLLIN;
-      ev.data.ptr = handle_address;
-      epoll_ctl_ex(epfd, EPOLL_CTL_MOD, sockfd, &ev);
+      // back to the idle events
+      if (idle_events) {
+        auto ev = epoll_event{};
+        ev.events = idle_events;
+        ev.data.ptr = handle_address;
+        epoll_ctl_ex(epfd, EPOLL_CTL_MOD, sockfd, &ev);
+      } else {
+        epoll_ctl_ex(epfd, EPOLL_CTL_DEL, sockfd, nullptr);
+      }
       // write message
       ret = write(sockfd, buf, len);
     }
@@ -152,17 +356,17 @@ struct WriteAwaiter {
   }
 };
 
-WriteAwaiter Write(int epfd, int fd, const char* buf, size_t len) {
+WriteAwaiter Write(int epfd, int fd, const char* buf, size_t len, uint32_t idle_events = EPOLLIN) {
 #ifdef SIMULATE_PARTIAL_WRITE // 模拟partial write
   len = len > 1 ? len / 2 : len;
 #endif
 
 #ifdef SIMULATE_BLOCK_WRITE // 模拟write阻塞的情况
-  return WriteAwaiter::Suspend(epfd, fd, buf, len);
+  return WriteAwaiter::Suspend(epfd, fd, buf, len, idle_events);
 #else
   auto ret = write(fd, buf, len);
-  auto ready = !(ret == -1 && (errno = EAGAIN || errno == EWOULDBLOCK));
-  return ready ? WriteAwaiter::Ready(fd, ret) : WriteAwaiter::Suspend(epfd, fd, buf, len);
+  auto ready = !(ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK));
+  return ready ? WriteAwaiter::Ready(fd, ret) : WriteAwaiter::Suspend(epfd, fd, buf, len, idle_events);
 #endif
 }
 
@@ -170,16 +374,18 @@ Coroutine HandleConnection(int epfd, int fd) {
   auto buff = std::string{};
   auto writable = (size_t)0;
   buff.resize(1024);
+  g_registry.SetBufferBytes(fd, buff.capacity());
   while (true) {
     if (writable) {
       auto r = co_await Write(epfd, fd, buff.data(), writable);
       if (r < 0) {
         std::cerr << "[" << fd << "] write failed: " << strerror(errno) << '\n';
         break;
-      } else if (r < writable) { // partial write
+      } else if ((size_t)r < writable) { // partial write
         std::move(buff.begin() + r, buff.begin() + writable, buff.begin());
       }
       writable -= r; 
+      g_admission.AddBuffered(-r);
     } else {
       auto nr = co_await Read(fd, buff.data(), buff.size());
       if (nr < 0) {
@@ -190,77 +396,599 @@ Coroutine HandleConnection(int epfd, int fd) {
         break;
       } else {
         writable = nr;
+        g_admission.AddBuffered(nr);
       }
     }
   }
+  g_admission.AddBuffered(-(ssize_t)writable);
+  g_admission.connections--;
+  metrics::Local().connections.Add(-1);
   epoll_ctl_ex(epfd, EPOLL_CTL_DEL, fd, nullptr);
   (void)close(fd);
   std::cout << "[" << fd << "] closed\n";
 }
 
-int main(int argc, char** argv) {
-  if (argc != 2) {
-    std::cerr << "Usage: " << argv[0] << " port\n";
-    return -1;
+// 按codec把字节流切分成消息(-f)：一次读到的数据里所有完整的消息都交给handler处理，
+// 消息是指向读缓冲区的string_view，不拷贝；所有回复编码到同一个缓冲区里一次写回。
+// 客户端pipeline发送多个请求时，每一批请求只需要一次唤醒、一次read和一次write
+template <class Codec, class Handler>
+Coroutine HandleFramed(int epfd, int fd, Codec codec, Handler handler) {
+  // 缓冲区的初始大小，处理完大消息后再缩回来，一个max_frame大小的消息不会让连接一直占着几MB内存
+  constexpr auto kBufferBytes = (size_t)16384;
+  auto in = std::string(kBufferBytes, '\0');
+  auto out = std::string{};
+  auto received = (size_t)0; // in中的字节数
+  auto pending = (size_t)0; // out中尚未写出的字节数
+  auto accounted = in.capacity();
+  g_registry.SetBufferBytes(fd, accounted);
+  auto account = [&]() {
+    if (auto bytes = in.capacity() + out.capacity(); bytes != accounted) {
+      g_registry.SetBufferBytes(fd, bytes);
+      accounted = bytes;
+    }
+  };
+  while (true) {
+    auto nr = co_await Read(fd, in.data() + received, in.size() - received);
+    if (nr < 0) {
+      std::cerr << "[" << fd << "] read failed: " << strerror(errno) << '\n';
+      break;
+    } else if (nr == 0) {
+      std::cout << "[" << fd << "] disconnected\n";
+      break;
+    }
+    received += nr;
+    auto consumed = codec.Decode(std::string_view(in.data(), received), [&](std::string_view request) {
+      codec.Encode(out, handler(request));
+    });
+    if (consumed < 0) {
+      std::cerr << "[" << fd << "] frame too large\n";
+      break;
+    }
+    // 不完整的消息移到缓冲区开头，缓冲区被一个消息占满时扩容，剩下的数据放得进初始大小时缩回
+    std::move(in.begin() + consumed, in.begin() + received, in.begin());
+    received -= consumed;
+    if (received == in.size()) {
+      in.resize(in.size() * 2);
+    } else if (in.size() > kBufferBytes && received < kBufferBytes) {
+      in.resize(kBufferBytes);
+      in.shrink_to_fit();
+    }
+    account();
+
+    pending = out.size();
+    g_admission.AddBuffered(pending);
+    while (pending) {
+      auto r = co_await Write(epfd, fd, out.data() + out.size() - pending, pending);
+      if (r < 0) {
+        std::cerr << "[" << fd << "] write failed: " << strerror(errno) << '\n';
+        break;
+      }
+      pending -= r;
+      g_admission.AddBuffered(-r);
+    }
+    if (pending) {
+      break;
+    }
+    out.clear();
+    if (out.capacity() > kBufferBytes) {
+      out.shrink_to_fit();
+      account();
+    }
   }
-  auto port = (uint16_t)atoi(argv[1]);
-  auto bindfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-  if (bindfd < 0) {
+  g_admission.AddBuffered(-(ssize_t)pending);
+  g_admission.connections--;
+  metrics::Local().connections.Add(-1);
+  epoll_ctl_ex(epfd, EPOLL_CTL_DEL, fd, nullptr);
+  (void)close(fd);
+  std::cout << "[" << fd << "] closed\n";
+}
+
+std::string_view Echo(std::string_view request) {
+  return request;
+}
+
+enum class Framing { kNone, kLength, kLine };
+
+auto g_framing = Framing::kNone;
+
+// 全双工模式(-d)下一个连接由两个协程处理：reader从fd读到ring里，writer把ring里的数据
+// 写到dup出来的另一个fd，写阻塞时也可以继续读。两个协程在同一个reactor线程上运行，
+// ring满时reader把fd移出epoll(不再读，对端的发送窗口随之关闭)并挂起，ring空时writer挂起，
+// 由对方唤醒。挂起在ring上的协程不在epoll中，所以只会被对方resume
+struct Duplex {
+  explicit Duplex(size_t ring_bytes) : ring{ring_bytes} {}
+  ~Duplex();
+
+  RingBuffer ring;
+  std::coroutine_handle<> reader; // ring满时挂起的reader
+  std::coroutine_handle<> writer; // ring空时挂起的writer
+  bool eof{false}; // reader已经退出
+  bool closed{false}; // writer已经退出
+};
+
+inline Duplex::~Duplex() {
+  g_admission.AddBuffered(-(ssize_t)ring.size());
+  g_admission.connections--;
+  metrics::Local().connections.Add(-1);
+}
+
+// 挂起并把handle存到slot里，等待Wake(slot)
+struct ParkAwaiter {
+  std::coroutine_handle<>& slot;
+  CoroutineHandle handle;
+  metrics::Clock::time_point suspended_at;
+
+  bool await_ready() const noexcept { return false; }
+
+  void await_suspend(CoroutineHandle h) {
+    slot = handle = h;
+    suspended_at = metrics::OnSuspend(metrics::Reason::kRing);
+    TRACE_SUSPEND_FD(kRing, h.promise().id, h.promise().fd);
+  }
+
+  std::coroutine_handle<> await_resume() const noexcept {
+    metrics::OnResume(suspended_at);
+    TRACE_RESUME_FD(kRing, handle.promise().id, handle.promise().fd);
+    return handle;
+  }
+};
+
+void Wake(std::coroutine_handle<>& slot) {
+  if (auto h = std::exchange(slot, nullptr)) {
+    h.resume();
+  }
+}
+
+// 0表示半双工
+auto g_ring_bytes = (size_t)0;
+
+Coroutine DuplexReader(int epfd, int fd, std::shared_ptr<Duplex> conn) {
+  auto& ring = conn->ring;
+  g_registry.SetBufferBytes(fd, ring.capacity());
+  auto registered = true;
+  while (!conn->closed) {
+    if (ring.full()) {
+      std::cout << "[" << fd << "] ring full, stop reading\n";
+      metrics::Local().backpressure_pauses.Add(1);
+      epoll_ctl_ex(epfd, EPOLL_CTL_DEL, fd, nullptr);
+      registered = false;
+      auto self = co_await ParkAwaiter{conn->reader};
+      if (conn->closed) {
+        break;
+      }
+      auto ev = epoll_event{};
+      ev.events = EPOLLIN;
+      ev.data.ptr = self.address();
+      epoll_ctl_ex(epfd, EPOLL_CTL_ADD, fd, &ev);
+      registered = true;
+    }
+    auto span = ring.WritableSpan();
+    auto nr = co_await Read(fd, span.data(), span.size());
+    if (nr < 0) {
+      std::cerr << "[" << fd << "] read failed: " << strerror(errno) << '\n';
+      break;
+    } else if (nr == 0) {
+      std::cout << "[" << fd << "] disconnected\n";
+      break;
+    }
+    ring.Commit(nr);
+    g_admission.AddBuffered(nr);
+    Wake(conn->writer);
+  }
+  conn->eof = true;
+  if (registered) {
+    epoll_ctl_ex(epfd, EPOLL_CTL_DEL, fd, nullptr);
+  }
+  (void)close(fd);
+  std::cout << "[" << fd << "] reader closed\n";
+  // writer写完ring里剩下的数据后退出
+  Wake(conn->writer);
+}
+
+// 协程创建后直接挂在conn->writer上，第一次有数据时由reader唤醒
+Coroutine DuplexWriter(int epfd, int fd, std::shared_ptr<Duplex> conn) {
+  auto& ring = conn->ring;
+  while (!ring.empty() || !conn->eof) {
+    if (ring.empty()) {
+      co_await ParkAwaiter{conn->writer};
+      continue;
+    }
+    auto span = ring.ReadableSpan();
+    auto r = co_await Write(epfd, fd, span.data(), span.size(), 0);
+    if (r < 0) {
+      std::cerr << "[" << fd << "] write failed: " << strerror(errno) << '\n';
+      // 让reader尽快退出：挂在read上的reader会读到EOF
+      (void)shutdown(fd, SHUT_RD);
+      break;
+    }
+    ring.Consume(r);
+    g_admission.AddBuffered(-r);
+    // 降到一半以下再恢复读，避免每写一点就唤醒一次reader
+    if (ring.size() <= ring.capacity() / 2) {
+      Wake(conn->reader);
+    }
+  }
+  conn->closed = true;
+  (void)close(fd);
+  std::cout << "[" << fd << "] writer closed\n";
+  Wake(conn->reader);
+}
+
+// 线程池的提交数、排队长度和延迟，Prometheus格式，接在metrics::Registry::Render()的输出后面
+std::string RenderOffloadMetrics(const OffloadPool& pool) {
+  auto stats = pool.stats();
+  auto out = std::ostringstream{};
+  out << "# HELP offload_submitted_total Jobs accepted by the offload pool.\n"
+      << "# TYPE offload_submitted_total counter\n"
+      << "offload_submitted_total " << stats.submitted << '\n'
+      << "# HELP offload_rejected_total Jobs rejected because the offload queue was full.\n"
+      << "# TYPE offload_rejected_total counter\n"
+      << "offload_rejected_total " << stats.rejected << '\n'
+      << "# HELP offload_queue_depth Jobs waiting for an offload worker.\n"
+      << "# TYPE offload_queue_depth gauge\n"
+      << "offload_queue_depth " << stats.queue_depth << '\n';
+  auto histogram = [&](const char* name, const char* help, const LatencyHistogram& h) {
+    out << "# HELP " << name << ' ' << help << '\n'
+        << "# TYPE " << name << " histogram\n";
+    // 桶和计数分别更新，用各个桶的和作为_count，保证+Inf和_count一致
+    auto cumulative = (uint64_t)0;
+    for (auto i = (size_t)0; i + 1 < LatencyHistogram::kBuckets; i++) {
+      cumulative += h.Bucket(i);
+      out << name << "_bucket{le=\"" << (double)((uint64_t)1 << i) / 1e6 << "\"} " << cumulative << '\n';
+    }
+    cumulative += h.Bucket(LatencyHistogram::kBuckets - 1);
+    out << name << "_bucket{le=\"+Inf\"} " << cumulative << '\n'
+        << name << "_sum " << h.Sum().count() / 1e6 << '\n'
+        << name << "_count " << cumulative << '\n';
+  };
+  histogram("offload_queue_seconds", "Time offloaded jobs waited in the queue.", *stats.queue_latency);
+  histogram("offload_run_seconds", "Time offloaded jobs ran on a worker.", *stats.run_latency);
+  return out.str();
+}
+
+// 管理端口：每个连接读取一次请求后关闭。读完请求后把fd移出epoll，
+// 这样在等待Offload时对端再发数据或者关闭连接也不会唤醒协程。
+// GET /trace?ms=N 返回最近N毫秒(默认1000)的Chrome trace JSON(需要-DENABLE_TRACE编译)，
+// 其余请求返回Prometheus格式的metrics
+Coroutine HandleAdmin(int epfd, int fd) {
+  auto request = std::string(4096, '\0');
+  g_registry.SetBufferBytes(fd, request.capacity());
+  auto nr = co_await Read(fd, request.data(), request.size());
+  epoll_ctl_ex(epfd, EPOLL_CTL_DEL, fd, nullptr);
+  if (nr > 0) {
+    request.resize(nr);
+    auto body = std::string{};
+    auto content_type = "text/plain; version=0.0.4";
+    if (request.starts_with("GET /trace")) {
+#ifdef ENABLE_TRACE
+      auto ms = 1000L;
+      if (auto pos = request.find("ms="); pos != std::string::npos) {
+        ms = atol(request.c_str() + pos + 3);
+      }
+      auto out = std::ostringstream{};
+      trace::Registry::Instance().DumpChromeTrace(out, std::chrono::milliseconds(ms));
+      body = out.str();
+      content_type = "application/json";
+#else
+      body = "tracing is disabled, rebuild with -DENABLE_TRACE\n";
+      content_type = "text/plain";
+#endif
+    } else {
+      // 捕获线程池指针而不是读g_offload_pool，worker上执行时reactor可能正在reset它
+      auto render = [pool = g_offload_pool.get()]() {
+        auto text = metrics::Registry::Instance().Render();
+        if (pool) {
+          text += RenderOffloadMetrics(*pool);
+        }
+        return text;
+      };
+      // 有线程池时在worker上生成，线程池队列满时退回到reactor线程上生成
+      auto rendered = std::optional<std::string>{};
+      if (g_offload_pool) {
+        rendered = co_await Offload(*g_offload_pool, *g_completions, render);
+      }
+      body = rendered ? std::move(*rendered) : render();
+    }
+    auto response = "HTTP/1.0 200 OK\r\n"
+                    "Content-Type: " + std::string(content_type) + "\r\n"
+                    "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                    "\r\n" + body;
+    auto written = (size_t)0;
+    while (written < response.size()) {
+      auto r = co_await Write(epfd, fd, response.data() + written, response.size() - written, 0);
+      if (r < 0) {
+        break;
+      }
+      written += r;
+    }
+  }
+  (void)close(fd);
+}
+
+// listen fd是非阻塞的，这样才能在一次唤醒中把backlog里的连接accept完
+int Listen(in_addr_t addr, uint16_t port, int backlog) {
+  auto fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+  if (fd < 0) {
     perror("socket");
     exit(EXIT_FAILURE);
   }
-  setsockopt_i(bindfd, SOL_SOCKET, SO_REUSEADDR, 1);
+  setsockopt_i(fd, SOL_SOCKET, SO_REUSEADDR, 1);
   auto bindaddr = sockaddr_in {
     .sin_family = AF_INET, 
     .sin_port = htons(port),
     .sin_addr = {
-      .s_addr = htons(INADDR_ANY)
+      .s_addr = htonl(addr)
     }
   };
-  if (auto r = bind(bindfd, (const sockaddr*)&bindaddr, sizeof(bindaddr)); r != 0) {
+  if (auto r = bind(fd, (const sockaddr*)&bindaddr, sizeof(bindaddr)); r != 0) {
     perror("bind");
     exit(EXIT_FAILURE);
   }
-  if (auto r = listen(bindfd, 100); r != 0) {
+  if (auto r = listen(fd, backlog); r != 0) {
     perror("listen");
     exit(EXIT_FAILURE);
   }
+  return fd;
+}
+
+// 接受一个连接，新的fd已经是非阻塞的。backlog为空或者失败时返回-1。
+// fd耗尽(EMFILE/ENFILE)时借助预留的fd接受并立即关闭这个连接：否则它会一直留在
+// backlog里，listen fd持续可读，reactor空转
+int AcceptOne(int listenfd) {
+  auto fd = accept4(listenfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd >= 0) {
+    std::cout << "[" << fd << "] connected\n";
+    return fd;
+  }
+  if ((errno == EMFILE || errno == ENFILE) && g_admission.reserve_fd >= 0) {
+    std::cerr << "accept: " << strerror(errno) << ", dropping connection\n";
+    (void)close(g_admission.reserve_fd);
+    if (fd = accept(listenfd, nullptr, nullptr); fd >= 0) {
+      (void)close(fd);
+    }
+    g_admission.reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    metrics::Local().connections_dropped.Add(1);
+  } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR) {
+    perror("accept");
+  }
+  return -1;
+}
+
+// 登记处理连接fd的协程，协程在第一次可读时开始执行
+void Spawn(int epfd, int fd, Coroutine coro,
+           ConnectionRegistry::Kind kind = ConnectionRegistry::Kind::kConnection) {
+  g_registry.Add(fd, coro, kind);
+  auto ev = epoll_event{};
+  ev.events = EPOLLIN;
+  ev.data.ptr = coro.address();
+  epoll_ctl_ex(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// 全双工连接：writer使用dup出来的fd，这样reader和writer在epoll中是两个独立的注册项
+void SpawnDuplex(int epfd, int fd) {
+  auto wfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (wfd < 0) {
+    perror("dup");
+    (void)close(fd);
+    g_admission.connections--;
+    metrics::Local().connections.Add(-1);
+    return;
+  }
+  auto conn = std::make_shared<Duplex>(g_ring_bytes);
+  auto writer = DuplexWriter(epfd, wfd, conn);
+  g_registry.Add(wfd, writer, ConnectionRegistry::Kind::kPeer);
+  conn->writer = writer;
+  Spawn(epfd, fd, DuplexReader(epfd, fd, conn));
+}
+
+// 一次唤醒中最多accept accept_budget个业务连接并按照准入策略处理，
+// 先把backlog取空，再统一创建处理连接的协程。shed模式下被关闭的连接同样计入budget，
+// 否则连接风暴时一次唤醒会一直accept再关闭，饿死已有的连接
+void AcceptConnections(int epfd, int bindfd) {
+  int fds[256];
+  auto n = 0;
+  for (auto attempts = 0; attempts < g_admission.accept_budget && !g_admission.paused; attempts++) {
+    // 过载时默认暂停accept，新连接留在backlog里
+    if (g_admission.Overloaded() && !g_admission.shed) {
+      std::cout << "overloaded: " << g_admission.connections << " connection(s), "
+                << g_admission.buffered_bytes << " buffered byte(s), pause accepting\n";
+      epoll_ctl_ex(epfd, EPOLL_CTL_DEL, bindfd, nullptr);
+      g_admission.paused = true;
+      metrics::Local().accept_pauses.Add(1);
+      break;
+    }
+    auto fd = AcceptOne(bindfd);
+    if (fd < 0) {
+      break;
+    }
+    if (g_admission.Overloaded()) {
+      // 只有shed模式才会在过载时继续accept，接受后立即关闭
+      std::cout << "[" << fd << "] overloaded, closed\n";
+      (void)close(fd);
+      metrics::Local().connections_dropped.Add(1);
+      continue;
+    }
+    fds[n++] = fd;
+    g_admission.connections++;
+  }
+  metrics::Local().connections.Add(n);
+  for (auto i = 0; i < n; i++) {
+    if (g_framing == Framing::kLength) {
+      Spawn(epfd, fds[i], HandleFramed(epfd, fds[i], LengthPrefixedCodec{}, Echo));
+    } else if (g_framing == Framing::kLine) {
+      Spawn(epfd, fds[i], HandleFramed(epfd, fds[i], DelimitedCodec{'\n'}, Echo));
+    } else if (g_ring_bytes) {
+      SpawnDuplex(epfd, fds[i]);
+    } else {
+      Spawn(epfd, fds[i], HandleConnection(epfd, fds[i]));
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  auto admin_port = 0;
+  auto backlog = 100;
+  auto offload_threads = 0;
+  auto offload_queue = 64;
+  auto opt = 0;
+  while ((opt = getopt(argc, argv, "a:b:c:d:f:m:n:o:q:s")) != -1) {
+    switch (opt) {
+      case 'a': admin_port = atoi(optarg); break;
+      case 'b': backlog = atoi(optarg); break;
+      case 'c': g_admission.max_connections = strtoul(optarg, nullptr, 10); break;
+      case 'd': g_ring_bytes = strtoul(optarg, nullptr, 10); break;
+      case 'f':
+        if (strcmp(optarg, "len") == 0) {
+          g_framing = Framing::kLength;
+        } else if (strcmp(optarg, "line") == 0) {
+          g_framing = Framing::kLine;
+        } else {
+          goto usage;
+        }
+        break;
+      case 'm': g_admission.max_buffered_bytes = strtoul(optarg, nullptr, 10); break;
+      case 'n': g_admission.accept_budget = atoi(optarg); break;
+      case 'o': offload_threads = atoi(optarg); break;
+      case 'q': offload_queue = atoi(optarg); break;
+      case 's': g_admission.shed = true; break;
+      default: goto usage;
+    }
+  }
+  if (optind + 1 != argc || g_admission.accept_budget <= 0 || g_admission.accept_budget > 256 ||
+      offload_queue <= 0 || (g_ring_bytes & (g_ring_bytes - 1)) ||
+      (g_ring_bytes && g_framing != Framing::kNone)) {
+usage:
+    std::cerr << "Usage: " << argv[0] << " [-a admin_port] [-b backlog] [-c max_connections]"
+              << " [-d ring_bytes | -f len|line] [-m max_buffered_bytes] [-n accept_budget]"
+              << " [-o offload_threads] [-q offload_queue] [-s] port\n"
+              << "  -a  serve Prometheus metrics on 127.0.0.1:admin_port\n"
+              << "  -b  listen backlog (default 100)\n"
+              << "  -c  pause accepting at this many connections\n"
+              << "  -d  full duplex: keep reading while writes are pending, buffering up to\n"
+              << "      ring_bytes (a power of two) per connection\n"
+              << "  -f  echo messages instead of raw bytes: 4-byte big-endian length prefixed\n"
+              << "      (len) or newline terminated (line), pipelined requests are batched\n"
+              << "  -m  pause accepting when this many received bytes are not yet echoed\n"
+              << "  -n  connections accepted per wakeup (1-256, default 64)\n"
+              << "  -o  run blocking work (e.g. rendering metrics) on this many threads\n"
+              << "  -q  queue at most this many jobs for the -o threads (default 64), reject\n"
+              << "      the rest and run them on the reactor instead\n"
+              << "  -s  when overloaded, accept and close new connections instead of pausing\n";
+    return -1;
+  }
+  auto port = (uint16_t)atoi(argv[optind]);
+  g_admission.reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  auto bindfd = Listen(INADDR_ANY, port, backlog);
   auto epfd = epoll_create(1);
   auto ev = epoll_event{};
   ev.events = EPOLLIN;
   ev.data.fd = bindfd;
   epoll_ctl_ex(epfd, EPOLL_CTL_ADD, bindfd, &ev);
+  auto adminfd = -1;
+  if (admin_port != 0) {
+    adminfd = Listen(INADDR_LOOPBACK, (uint16_t)admin_port, 16);
+    ev.events = EPOLLIN;
+    ev.data.fd = adminfd;
+    epoll_ctl_ex(epfd, EPOLL_CTL_ADD, adminfd, &ev);
+  }
+  // SIGINT/SIGTERM触发drain：停止accept，关闭所有连接的读端等待它们自行结束，
+  // 超时或者再次收到信号时强制销毁剩余的连接
+  auto signals = sigset_t{};
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigprocmask(SIG_BLOCK, &signals, nullptr);
+  auto sigfd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  ev.events = EPOLLIN;
+  ev.data.fd = sigfd;
+  epoll_ctl_ex(epfd, EPOLL_CTL_ADD, sigfd, &ev);
+  // worker线程继承信号屏蔽字，必须在屏蔽SIGINT/SIGTERM之后创建，否则信号可能被投递给worker
+  if (offload_threads > 0) {
+    g_completions = std::make_unique<CompletionQueue>();
+    g_offload_pool = std::make_unique<OffloadPool>(offload_threads, offload_queue);
+    ev.events = EPOLLIN;
+    ev.data.fd = g_completions->fd();
+    epoll_ctl_ex(epfd, EPOLL_CTL_ADD, g_completions->fd(), &ev);
+  }
+  auto draining = false;
+  auto drain_deadline = metrics::Clock::time_point{};
+
+  auto& stats = metrics::Local();
   epoll_event events[128];
-  for (;;) {
-    auto ne = epoll_wait(epfd, events, sizeof(events)/sizeof(events[0]), -1);
+  while (!draining || g_registry.size() > 0) {
+    auto timeout = -1;
+    if (draining) {
+      auto left = std::chrono::ceil<std::chrono::milliseconds>(drain_deadline - metrics::Clock::now());
+      timeout = std::max(0, (int)left.count());
+    }
+    auto ne = epoll_wait(epfd, events, sizeof(events)/sizeof(events[0]), timeout);
     if (ne == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
       perror("epoll_wait");
       exit(EXIT_FAILURE);
     }
+    if (ne == 0 && draining) {
+      std::cout << "drain timed out, destroying " << g_registry.connections() << " connection(s)\n";
+      DestroyConnections(epfd);
+      break;
+    }
+    metrics::OnEpollWakeup(ne);
+    auto ready = 0;
     for (auto i = 0; i < ne; i++) {
       auto& e = events[i];
       if (e.data.fd == bindfd) {
-        auto peer_addr = sockaddr_in {};
-        auto addr_len = (socklen_t)(sizeof(peer_addr));
-        auto fd = accept(bindfd, (sockaddr*)&peer_addr, &addr_len);
-        if (fd < 0) {
-          perror("accept");
-          exit(EXIT_FAILURE);
+        AcceptConnections(epfd, bindfd);
+      } else if (e.data.fd == adminfd) {
+        if (auto fd = AcceptOne(adminfd); fd >= 0) {
+          Spawn(epfd, fd, HandleAdmin(epfd, fd), ConnectionRegistry::Kind::kAdmin);
+        }
+      } else if (g_completions && e.data.fd == g_completions->fd()) {
+        ready += (int)g_completions->Drain();
+      } else if (e.data.fd == sigfd) {
+        auto info = signalfd_siginfo{};
+        while (read(sigfd, &info, sizeof(info)) == sizeof(info)) {
+        }
+        if (draining) {
+          std::cout << "destroying " << g_registry.connections() << " connection(s)\n";
+          DestroyConnections(epfd);
+          break;
+        }
+        std::cout << "draining " << g_registry.connections() << " connection(s), "
+                  << g_registry.MemoryPerConnection() << " byte(s) per connection\n";
+        draining = true;
+        drain_deadline = metrics::Clock::now() + std::chrono::seconds(5);
+        if (!g_admission.paused) {
+          epoll_ctl_ex(epfd, EPOLL_CTL_DEL, bindfd, nullptr);
         }
-        std::cout << "[" << fd << "]: " << ToString(peer_addr) << " connected\n";
-        setnonblock(fd);
-        auto coro = HandleConnection(epfd, fd);
-        ev = epoll_event{};
-        ev.events = EPOLLIN;
-        ev.data.ptr = coro.address();
-        epoll_ctl_ex(epfd, EPOLL_CTL_ADD, fd, &ev);
+        // drain期间保持paused：同一批事件里后面的bindfd事件也不会再accept
+        g_admission.paused = true;
+        g_registry.Drain();
       } else {
         auto handle = std::coroutine_handle<>::from_address(e.data.ptr);
+        auto start = metrics::Clock::now();
         handle.resume();
+        stats.running_ns.Add(std::chrono::nanoseconds(metrics::Clock::now() - start).count());
+        ready++;
       }
     }
+    metrics::OnReadyCoroutines(ready);
+    if (g_admission.paused && !draining && g_admission.BelowLowWater()) {
+      std::cout << "load dropped, resume accepting\n";
+      ev.events = EPOLLIN;
+      ev.data.fd = bindfd;
+      epoll_ctl_ex(epfd, EPOLL_CTL_ADD, bindfd, &ev);
+      g_admission.paused = false;
+    }
+  }
+  g_offload_pool.reset();
+  std::cout << "bye" << std::endl;
+  (void)close(sigfd);
+  (void)close(bindfd);
+  if (adminfd >= 0) {
+    (void)close(adminfd);
   }
+  (void)close(epfd);
   return 0;
 }
-
-
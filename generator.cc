@@ -1,10 +1,17 @@
+#include <chrono>
 #include <coroutine>
 #include <iostream>
+#include <iterator>
+#include <optional>
+#include <ranges>
 #include <type_traits>
 #include <source_location>
+#include <utility>
 
+// Generator是一个只能遍历一次的std::ranges::input_range，同时也是一个view，
+// 可以直接和std::views组合使用
 template <typename T>
-class Generator {
+class Generator : public std::ranges::view_base {
 public:
     class promise_type;
     class Iter;
@@ -12,6 +19,16 @@ public:
 
     explicit Generator(Handle h) : handle_{h} {}
 
+    Generator(Generator&& other) noexcept : handle_{std::exchange(other.handle_, {})} {}
+
+    Generator& operator=(Generator&& other) noexcept {
+        if (this != &other) {
+            if (handle_) handle_.destroy();
+            handle_ = std::exchange(other.handle_, {});
+        }
+        return *this;
+    }
+
     ~Generator() { if (handle_) handle_.destroy(); }
 
     auto begin() -> Iter;
@@ -33,6 +50,7 @@ public:
         value_ = obj;
         return {};
     }
+    void return_void() {}
     void unhandled_exception() {}
 
     auto value() const -> T { return value_; }
@@ -44,24 +62,39 @@ private:
 template <typename T>
 class Generator<T>::Iter {
 public:
+    using iterator_concept = std::input_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+
+    Iter() = default;
+
     explicit Iter(Handle handle) : handle_(handle) {}
 
-    auto operator*() const {
+    auto operator*() const -> T {
         return handle_.promise().value();
     }
 
-    auto operator++() {
+    auto operator++() -> Iter& {
         handle_.resume();
+        return *this;
+    }
+
+    void operator++(int) {
+        ++*this;
     }
 
-    auto operator==(std::default_sentinel_t /*sentinel*/) {
+    auto operator==(std::default_sentinel_t /*sentinel*/) const -> bool {
         return !handle_ || handle_.done();
     }
 
 private:
-    Handle handle_;
+    Handle handle_{};
 };
 
+static_assert(std::input_iterator<Generator<int>::Iter>);
+static_assert(std::ranges::input_range<Generator<int>>);
+static_assert(std::ranges::view<Generator<int>>);
+
 template <typename T>
 auto Generator<T>::begin() -> Iter {
     return Iter{handle_};
@@ -88,6 +121,134 @@ Generator<T> xrange(T first, T last, T step=1) {
     }
 }
 
+// 可融合的range adaptor：source | fused::Map(f) | fused::Filter(p) | fused::Take(n)
+// 把所有stage合成一个函数，整条pipeline只在一个协程帧里执行，每个元素只需要
+// resume一次融合后的协程(外加一次source的resume)，而不是每个stage各resume一次。
+//
+// 每个stage都是push风格的：stage(x, sink)处理一个元素，把结果交给下一级的sink，
+// 返回true表示不再需要更多元素。所有stage内联后在融合的协程里就是一段普通的循环体。
+namespace fused {
+
+template <typename F>
+struct Map { F fn; };
+
+template <typename P>
+struct Filter { P pred; };
+
+struct Take { size_t count; };
+
+template <typename V, typename T, typename Fn>
+Generator<V> Fuse(Generator<T> source, Fn fn) {
+    auto out = std::optional<V>{};
+    auto sink = [&out](V v) {
+        out.emplace(std::move(v));
+        return false;
+    };
+    for (auto&& x : source) {
+        auto stop = fn(std::move(x), sink);
+        if (out) {
+            co_yield std::move(*out);
+            out.reset();
+        }
+        if (stop) {
+            co_return;
+        }
+    }
+}
+
+// 尚未开始执行的pipeline，begin()时才创建融合后的协程
+template <typename T, typename V, typename Fn>
+class Pipeline {
+public:
+    using value_type = V;
+
+    Pipeline(Generator<T> source, Fn fn) : source_{std::move(source)}, fn_{std::move(fn)} {}
+
+    auto begin() {
+        fused_.emplace(Fuse<V>(std::move(source_), std::move(fn_)));
+        return fused_->begin();
+    }
+
+    auto end() -> std::default_sentinel_t { return std::default_sentinel; }
+
+    // 在pipeline末尾追加一个输出类型为U的stage
+    template <typename U, typename Stage>
+    auto Then(Stage stage) && {
+        auto next = [fn = std::move(fn_), stage = std::move(stage)](T x, auto& sink) mutable {
+            auto stage_sink = [&stage, &sink](V v) { return stage(std::move(v), sink); };
+            return fn(std::move(x), stage_sink);
+        };
+        return Pipeline<T, U, decltype(next)>{std::move(source_), std::move(next)};
+    }
+
+private:
+    Generator<T> source_;
+    Fn fn_;
+    std::optional<Generator<V>> fused_{};
+};
+
+template <typename T>
+auto Start(Generator<T> source) {
+    auto identity = [](T x, auto& sink) { return sink(std::move(x)); };
+    return Pipeline<T, T, decltype(identity)>{std::move(source), std::move(identity)};
+}
+
+template <typename T, typename V, typename Fn, typename F>
+auto operator|(Pipeline<T, V, Fn>&& p, Map<F> m) {
+    return std::move(p).template Then<std::invoke_result_t<F&, V>>(
+        [fn = std::move(m.fn)](V x, auto& sink) mutable { return sink(fn(std::move(x))); });
+}
+
+template <typename T, typename V, typename Fn, typename P>
+auto operator|(Pipeline<T, V, Fn>&& p, Filter<P> f) {
+    return std::move(p).template Then<V>(
+        [pred = std::move(f.pred)](V x, auto& sink) mutable { return pred(x) ? sink(std::move(x)) : false; });
+}
+
+template <typename T, typename V, typename Fn>
+auto operator|(Pipeline<T, V, Fn>&& p, Take t) {
+    return std::move(p).template Then<V>(
+        [count = t.count, taken = (size_t)0](V x, auto& sink) mutable {
+            if (taken >= count) return true;
+            return sink(std::move(x)) || ++taken == count;
+        });
+}
+
+template <typename T, typename Stage>
+auto operator|(Generator<T>&& g, Stage stage) -> decltype(Start(std::move(g)) | std::move(stage)) {
+    return Start(std::move(g)) | std::move(stage);
+}
+
+} // namespace fused
+
+// 不融合的写法：每个stage都是一个独立的协程
+template <typename T, typename F>
+auto MapGenerator(Generator<T> source, F fn) -> Generator<std::invoke_result_t<F&, T>> {
+    for (auto x : source) co_yield fn(x);
+}
+
+template <typename T, typename P>
+Generator<T> FilterGenerator(Generator<T> source, P pred) {
+    for (auto x : source) if (pred(x)) co_yield x;
+}
+
+template <typename T>
+Generator<T> TakeGenerator(Generator<T> source, size_t count) {
+    if (count == 0) co_return;
+    for (auto x : source) {
+        co_yield x;
+        if (--count == 0) co_return;
+    }
+}
+
+template <typename F>
+void Benchmark(const char* name, F run) {
+    auto start = std::chrono::steady_clock::now();
+    auto sum = run();
+    auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+    std::cout << name << ": sum=" << sum << ", " << elapsed.count() << "ms\n";
+}
+
 int main() {
     std::cout << "xrange(1, 1)\n";
     for (auto n : xrange(1, 1)) {
@@ -113,5 +274,36 @@ int main() {
     for (auto n : xrange(10, 1, -2)) {
         std::cout << n << '\n';
     }
+    std::cout << "xrange(0, 10) | filter(odd) | transform(square)\n";
+    for (auto n : xrange(0, 10) | std::views::filter([](int n) { return n % 2; })
+                                | std::views::transform([](int n) { return n * n; })) {
+        std::cout << n << '\n';
+    }
+    std::cout << "xrange(0, 100) | fused::Filter(odd) | fused::Map(square) | fused::Take(3)\n";
+    for (auto n : xrange(0, 100) | fused::Filter{[](int n) { return n % 2; }}
+                                 | fused::Map{[](int n) { return n * n; }}
+                                 | fused::Take{3}) {
+        std::cout << n << '\n';
+    }
+
+    constexpr auto kN = 1'000'000L;
+    auto odd = [](long n) { return n % 2 == 1; };
+    auto square = [](long n) { return n * n; };
+    auto plus_one = [](long n) { return n + 1; };
+    Benchmark("chained generators (5 frames)", [&]() {
+        auto sum = 0L;
+        for (auto n : TakeGenerator(MapGenerator(FilterGenerator(MapGenerator(xrange(0L, kN), plus_one), odd), square), kN / 4)) {
+            sum += n;
+        }
+        return sum;
+    });
+    Benchmark("fused pipeline (2 frames)", [&]() {
+        auto sum = 0L;
+        for (auto n : xrange(0L, kN) | fused::Map{plus_one} | fused::Filter{odd}
+                                     | fused::Map{square} | fused::Take{kN / 4}) {
+            sum += n;
+        }
+        return sum;
+    });
     return 0;
 }
@@ -0,0 +1,235 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Runtime metrics of the coroutine reactor. Every thread updates its own
+// cache-line aligned Slot without any read-modify-write atomics, a scrape sums
+// all slots and renders them in Prometheus text format.
+namespace metrics {
+
+using Clock = std::chrono::steady_clock;
+
+// kRing: waiting on the ring buffer shared with the other coroutine of a connection
+enum class Reason { kRead, kWrite, kTimer, kRing };
+
+inline constexpr size_t kReasons = 4;
+inline constexpr const char* kReasonNames[kReasons] = {"read", "write", "timer", "ring"};
+
+// Upper bounds of the epoll events per wakeup and the ready coroutines per
+// wakeup histograms, the last bucket is +Inf
+inline constexpr std::array<int64_t, 8> kEventBounds = {1, 2, 4, 8, 16, 32, 64, 128};
+
+using EventBuckets = std::array<int64_t, kEventBounds.size() + 1>;
+
+// Counter or gauge written by exactly one thread and read by any thread
+class Cell {
+public:
+  void Add(int64_t delta) noexcept {
+    v_.store(v_.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+  }
+
+  void Set(int64_t v) noexcept { v_.store(v, std::memory_order_relaxed); }
+
+  int64_t Get() const noexcept { return v_.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<int64_t> v_{0};
+};
+
+struct alignas(64) Slot {
+  Cell live_coroutines;
+  std::array<Cell, kReasons> suspensions;
+  Cell suspended_ns;
+  Cell running_ns;
+  std::array<Cell, kEventBounds.size() + 1> events;
+  Cell events_sum;
+  std::array<Cell, kEventBounds.size() + 1> ready;
+  Cell ready_sum;
+  Cell timer_heap_size;
+  Cell connections;
+  Cell buffered_bytes;
+  Cell connections_dropped;
+  Cell accept_pauses;
+  Cell frame_bytes;
+  Cell connection_buffer_bytes;
+  Cell connection_memory_bytes;
+  Cell backpressure_pauses;
+};
+
+class Registry {
+public:
+  // Never destroyed, threads may still update their slots during exit
+  static Registry& Instance() {
+    static auto obj = new Registry();
+    return *obj;
+  }
+
+  // Slots are never freed so that a scrape can race with thread exit
+  Slot* NewSlot();
+
+  std::string Render() const;
+
+private:
+  mutable std::mutex mtx_;
+  std::vector<std::unique_ptr<Slot>> slots_;
+};
+
+inline Slot* Registry::NewSlot() {
+  auto l = std::lock_guard(mtx_);
+  slots_.push_back(std::make_unique<Slot>());
+  return slots_.back().get();
+}
+
+inline std::string Registry::Render() const {
+  auto live = (int64_t)0;
+  auto suspensions = std::array<int64_t, kReasons>{};
+  auto suspended_ns = (int64_t)0;
+  auto running_ns = (int64_t)0;
+  auto events = EventBuckets{};
+  auto events_sum = (int64_t)0;
+  auto ready = EventBuckets{};
+  auto ready_sum = (int64_t)0;
+  auto timers = (int64_t)0;
+  auto connections = (int64_t)0;
+  auto buffered = (int64_t)0;
+  auto dropped = (int64_t)0;
+  auto pauses = (int64_t)0;
+  auto frame_bytes = (int64_t)0;
+  auto buffer_bytes = (int64_t)0;
+  auto connection_memory = (int64_t)0;
+  auto backpressure = (int64_t)0;
+  {
+    auto l = std::lock_guard(mtx_);
+    for (auto& s : slots_) {
+      live += s->live_coroutines.Get();
+      for (auto i = (size_t)0; i < kReasons; i++) {
+        suspensions[i] += s->suspensions[i].Get();
+      }
+      suspended_ns += s->suspended_ns.Get();
+      running_ns += s->running_ns.Get();
+      for (auto i = (size_t)0; i < events.size(); i++) {
+        events[i] += s->events[i].Get();
+        ready[i] += s->ready[i].Get();
+      }
+      events_sum += s->events_sum.Get();
+      ready_sum += s->ready_sum.Get();
+      timers += s->timer_heap_size.Get();
+      connections += s->connections.Get();
+      buffered += s->buffered_bytes.Get();
+      dropped += s->connections_dropped.Get();
+      pauses += s->accept_pauses.Get();
+      frame_bytes += s->frame_bytes.Get();
+      buffer_bytes += s->connection_buffer_bytes.Get();
+      connection_memory += s->connection_memory_bytes.Get();
+      backpressure += s->backpressure_pauses.Get();
+    }
+  }
+
+  auto out = std::ostringstream{};
+  auto histogram = [&](const char* name, const EventBuckets& buckets, int64_t sum) {
+    auto cumulative = (int64_t)0;
+    for (auto i = (size_t)0; i < kEventBounds.size(); i++) {
+      cumulative += buckets[i];
+      out << name << "_bucket{le=\"" << kEventBounds[i] << "\"} " << cumulative << '\n';
+    }
+    cumulative += buckets.back();
+    out << name << "_bucket{le=\"+Inf\"} " << cumulative << '\n'
+        << name << "_sum " << sum << '\n'
+        << name << "_count " << cumulative << '\n';
+  };
+  out << "# HELP coro_live Coroutines that have started and not yet finished.\n"
+      << "# TYPE coro_live gauge\n"
+      << "coro_live " << live << '\n'
+      << "# HELP coro_suspensions_total Coroutine suspensions by reason.\n"
+      << "# TYPE coro_suspensions_total counter\n";
+  for (auto i = (size_t)0; i < kReasons; i++) {
+    out << "coro_suspensions_total{reason=\"" << kReasonNames[i] << "\"} " << suspensions[i] << '\n';
+  }
+  out << "# HELP coro_suspended_seconds_total Time coroutines spent suspended.\n"
+      << "# TYPE coro_suspended_seconds_total counter\n"
+      << "coro_suspended_seconds_total " << suspended_ns / 1e9 << '\n'
+      << "# HELP coro_running_seconds_total Time the reactor spent running coroutines.\n"
+      << "# TYPE coro_running_seconds_total counter\n"
+      << "coro_running_seconds_total " << running_ns / 1e9 << '\n'
+      << "# HELP reactor_epoll_events Events returned by one epoll_wait.\n"
+      << "# TYPE reactor_epoll_events histogram\n";
+  histogram("reactor_epoll_events", events, events_sum);
+  out << "# HELP reactor_ready_coroutines Coroutines resumed by one wakeup, from epoll events or offload completions.\n"
+      << "# TYPE reactor_ready_coroutines histogram\n";
+  histogram("reactor_ready_coroutines", ready, ready_sum);
+  out << "# HELP timer_heap_size Pending timer events.\n"
+      << "# TYPE timer_heap_size gauge\n"
+      << "timer_heap_size " << timers << '\n'
+      << "# HELP server_connections Accepted connections that are still open.\n"
+      << "# TYPE server_connections gauge\n"
+      << "server_connections " << connections << '\n'
+      << "# HELP server_buffered_bytes Received bytes not yet written back.\n"
+      << "# TYPE server_buffered_bytes gauge\n"
+      << "server_buffered_bytes " << buffered << '\n'
+      << "# HELP server_connections_dropped_total Connections closed right after accept by admission control.\n"
+      << "# TYPE server_connections_dropped_total counter\n"
+      << "server_connections_dropped_total " << dropped << '\n'
+      << "# HELP server_accept_pauses_total Times accepting was paused because of overload.\n"
+      << "# TYPE server_accept_pauses_total counter\n"
+      << "server_accept_pauses_total " << pauses << '\n'
+      << "# HELP server_backpressure_pauses_total Times a full-duplex connection stopped reading because its ring was full.\n"
+      << "# TYPE server_backpressure_pauses_total counter\n"
+      << "server_backpressure_pauses_total " << backpressure << '\n'
+      << "# HELP coro_frame_bytes Heap memory held by coroutine frames.\n"
+      << "# TYPE coro_frame_bytes gauge\n"
+      << "coro_frame_bytes " << frame_bytes << '\n'
+      << "# HELP server_connection_buffer_bytes Heap memory held by connection buffers.\n"
+      << "# TYPE server_connection_buffer_bytes gauge\n"
+      << "server_connection_buffer_bytes " << buffer_bytes << '\n'
+      << "# HELP server_memory_per_connection_bytes Frame and buffer memory per accepted connection.\n"
+      << "# TYPE server_memory_per_connection_bytes gauge\n"
+      << "server_memory_per_connection_bytes " << (connections > 0 ? connection_memory / connections : 0) << '\n';
+  return out.str();
+}
+
+// Slot of the calling thread
+inline Slot& Local() {
+  thread_local auto slot = Registry::Instance().NewSlot();
+  return *slot;
+}
+
+// Call from await_suspend, pass the returned time point to OnResume()
+inline Clock::time_point OnSuspend(Reason reason) noexcept {
+  Local().suspensions[(size_t)reason].Add(1);
+  return Clock::now();
+}
+
+inline void OnResume(Clock::time_point suspended_at) noexcept {
+  Local().suspended_ns.Add(std::chrono::nanoseconds(Clock::now() - suspended_at).count());
+}
+
+inline size_t EventBucket(int64_t n) noexcept {
+  auto bucket = (size_t)0;
+  while (bucket < kEventBounds.size() && n > kEventBounds[bucket]) {
+    bucket++;
+  }
+  return bucket;
+}
+
+inline void OnEpollWakeup(int events) noexcept {
+  auto& slot = Local();
+  slot.events[EventBucket(events)].Add(1);
+  slot.events_sum.Add(events);
+}
+
+// Call once the events of a wakeup are handled, with the number of coroutines
+// they resumed
+inline void OnReadyCoroutines(int ready) noexcept {
+  auto& slot = Local();
+  slot.ready[EventBucket(ready)].Add(1);
+  slot.ready_sum.Add(ready);
+}
+
+} // namespace metrics
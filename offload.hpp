@@ -0,0 +1,275 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "blocking_queue.hpp"
+
+// Latency histogram with power-of-two microsecond buckets, safe to update
+// from any thread. Bucket i counts latencies below 2^i us, the last bucket
+// also holds everything larger.
+class LatencyHistogram {
+public:
+  static constexpr size_t kBuckets = 32;
+
+  void Record(std::chrono::nanoseconds d) noexcept;
+
+  uint64_t Count() const noexcept { return count_.load(std::memory_order_relaxed); }
+
+  uint64_t Bucket(size_t i) const noexcept { return buckets_[i].load(std::memory_order_relaxed); }
+
+  std::chrono::microseconds Sum() const noexcept {
+    return std::chrono::microseconds(sum_us_.load(std::memory_order_relaxed));
+  }
+
+  std::chrono::microseconds Max() const noexcept {
+    return std::chrono::microseconds(max_us_.load(std::memory_order_relaxed));
+  }
+
+  std::chrono::microseconds Mean() const noexcept;
+
+  // Upper bound of the bucket holding the q-th quantile, q in [0, 1]
+  std::chrono::microseconds Percentile(double q) const noexcept;
+
+private:
+  std::array<std::atomic<uint64_t>, kBuckets> buckets_{};
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> sum_us_{0};
+  std::atomic<uint64_t> max_us_{0};
+};
+
+inline void LatencyHistogram::Record(std::chrono::nanoseconds d) noexcept {
+  auto us = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+  auto bucket = us == 0 ? 0 : std::min<size_t>(64 - __builtin_clzll(us), kBuckets - 1);
+  buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_us_.fetch_add(us, std::memory_order_relaxed);
+  auto max = max_us_.load(std::memory_order_relaxed);
+  while (us > max && !max_us_.compare_exchange_weak(max, us, std::memory_order_relaxed)) {
+  }
+}
+
+inline std::chrono::microseconds LatencyHistogram::Mean() const noexcept {
+  auto n = Count();
+  return std::chrono::microseconds(n ? sum_us_.load(std::memory_order_relaxed) / n : 0);
+}
+
+inline std::chrono::microseconds LatencyHistogram::Percentile(double q) const noexcept {
+  auto target = (uint64_t)(q * Count());
+  auto seen = (uint64_t)0;
+  for (auto i = (size_t)0; i < kBuckets; i++) {
+    seen += buckets_[i].load(std::memory_order_relaxed);
+    if (seen > target) {
+      return std::chrono::microseconds(i == 0 ? 0 : (uint64_t)1 << i);
+    }
+  }
+  return Max();
+}
+
+// Coroutines that are ready to run again on the reactor that owns this queue.
+// Worker threads Post() handles, the reactor watches fd() for EPOLLIN and
+// calls Drain() so that every coroutine resumes on the thread it started on.
+class CompletionQueue {
+public:
+  CompletionQueue();
+
+  ~CompletionQueue();
+
+  CompletionQueue(const CompletionQueue&) = delete;
+  CompletionQueue& operator=(const CompletionQueue&) = delete;
+
+  int fd() const noexcept { return fd_; }
+
+  // Thread safe
+  void Post(std::coroutine_handle<> h);
+
+  // Reactor thread only. Resume all posted coroutines, return how many
+  size_t Drain();
+
+private:
+  int fd_;
+  std::mutex mtx_;
+  std::vector<std::coroutine_handle<>> ready_;
+  std::vector<std::coroutine_handle<>> running_;
+};
+
+inline CompletionQueue::CompletionQueue() : fd_{eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)} {
+  if (fd_ < 0) {
+    perror("eventfd");
+    exit(EXIT_FAILURE);
+  }
+}
+
+inline CompletionQueue::~CompletionQueue() {
+  (void)close(fd_);
+}
+
+inline void CompletionQueue::Post(std::coroutine_handle<> h) {
+  auto l = std::unique_lock(mtx_);
+  ready_.push_back(h);
+  auto wakeup = ready_.size() == 1;
+  l.unlock();
+  // Only the first post after a Drain() needs to wake the reactor up
+  if (wakeup) {
+    auto one = (uint64_t)1;
+    (void)!write(fd_, &one, sizeof(one));
+  }
+}
+
+inline size_t CompletionQueue::Drain() {
+  auto counter = (uint64_t)0;
+  (void)!read(fd_, &counter, sizeof(counter));
+  {
+    auto l = std::lock_guard(mtx_);
+    running_.swap(ready_);
+  }
+  for (auto h : running_) {
+    h.resume();
+  }
+  auto n = running_.size();
+  running_.clear();
+  return n;
+}
+
+// Fixed-size worker pool with a bounded job queue for blocking calls and
+// CPU-heavy work. Submission never blocks: when the queue is full the job is
+// rejected, so a slow handler cannot stall the reactor that submits it.
+//
+// The destructor runs every job still queued and joins the workers. Jobs
+// created by Offload() Post() to a CompletionQueue and write into the awaiting
+// coroutine's frame, so destroy the pool before those CompletionQueues and
+// before destroying any coroutine that is still waiting on an Offload().
+class OffloadPool {
+public:
+  using Job = std::function<void()>;
+
+  struct Stats {
+    uint64_t submitted;
+    uint64_t rejected;
+    size_t queue_depth;
+    const LatencyHistogram* queue_latency;
+    const LatencyHistogram* run_latency;
+  };
+
+  OffloadPool(size_t threads, size_t max_queue);
+
+  ~OffloadPool();
+
+  OffloadPool(const OffloadPool&) = delete;
+  OffloadPool& operator=(const OffloadPool&) = delete;
+
+  // Returns false if the queue is full
+  bool TrySubmit(Job job);
+
+  void RecordQueueLatency(std::chrono::nanoseconds d) noexcept { queue_latency_.Record(d); }
+
+  void RecordRunLatency(std::chrono::nanoseconds d) noexcept { run_latency_.Record(d); }
+
+  Stats stats() const noexcept;
+
+private:
+  void Run();
+
+  BlockingQueue<Job> queue_;
+  std::atomic<uint64_t> submitted_{0};
+  std::atomic<uint64_t> rejected_{0};
+  LatencyHistogram queue_latency_;
+  LatencyHistogram run_latency_;
+  std::vector<std::thread> threads_;
+};
+
+inline OffloadPool::OffloadPool(size_t threads, size_t max_queue) : queue_{max_queue} {
+  for (auto i = (size_t)0; i < threads; i++) {
+    threads_.emplace_back([this]() { Run(); });
+  }
+}
+
+inline OffloadPool::~OffloadPool() {
+  // An empty job tells one worker to exit
+  for (auto i = (size_t)0; i < threads_.size(); i++) {
+    queue_.put(Job{});
+  }
+  for (auto& t : threads_) {
+    t.join();
+  }
+}
+
+inline bool OffloadPool::TrySubmit(Job job) {
+  if (!queue_.offer(std::move(job))) {
+    rejected_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  submitted_.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+inline auto OffloadPool::stats() const noexcept -> Stats {
+  return Stats{
+    .submitted = submitted_.load(std::memory_order_relaxed),
+    .rejected = rejected_.load(std::memory_order_relaxed),
+    .queue_depth = queue_.size(),
+    .queue_latency = &queue_latency_,
+    .run_latency = &run_latency_,
+  };
+}
+
+inline void OffloadPool::Run() {
+  while (auto job = queue_.take()) {
+    job();
+  }
+}
+
+// co_await Offload(pool, cq, fn) runs fn() on a worker of pool and resumes the
+// awaiting coroutine through cq, i.e. on the reactor that owns cq. fn must not
+// throw.
+// The result is std::nullopt if the pool rejected the job because its queue is
+// full; a void fn yields std::optional<std::monostate>.
+template <class Fn>
+auto Offload(OffloadPool& pool, CompletionQueue& cq, Fn fn) {
+  using R = std::invoke_result_t<Fn&>;
+  using Result = std::conditional_t<std::is_void_v<R>, std::monostate, R>;
+  using Clock = std::chrono::steady_clock;
+
+  struct awaiter {
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h) {
+      auto submitted_at = Clock::now();
+      // Returning false resumes the caller immediately with std::nullopt
+      return pool.TrySubmit([this, h, submitted_at]() {
+        auto started_at = Clock::now();
+        if constexpr (std::is_void_v<R>) {
+          fn();
+          result.emplace();
+        } else {
+          result.emplace(fn());
+        }
+        pool.RecordQueueLatency(started_at - submitted_at);
+        pool.RecordRunLatency(Clock::now() - started_at);
+        cq.Post(h);
+      });
+    }
+
+    std::optional<Result> await_resume() { return std::move(result); }
+
+    OffloadPool& pool;
+    CompletionQueue& cq;
+    Fn fn;
+    std::optional<Result> result{};
+  };
+  return awaiter{pool, cq, std::move(fn)};
+}
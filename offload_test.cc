@@ -0,0 +1,115 @@
+#include <chrono>
+#include <coroutine>
+#include <iostream>
+#include <latch>
+#include <thread>
+#include <vector>
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "offload.hpp"
+
+struct Task {
+  struct promise_type {
+    Task get_return_object() { return {std::coroutine_handle<promise_type>::from_promise(*this)}; }
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    std::suspend_never final_suspend() const noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() {}
+  };
+
+  std::coroutine_handle<promise_type> handle;
+};
+
+// 模拟一个阻塞调用(例如文件IO或DNS解析)
+int SlowSquare(int n) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  return n * n;
+}
+
+constexpr auto kWorkers = 4;
+
+// 让前kWorkers个任务占住所有worker：开始执行后等到其余任务都提交完才继续，
+// 这样队列里有哪些任务、哪些被拒绝不依赖线程调度的时机
+struct Gate {
+  std::latch started{kWorkers};
+  std::latch release{1};
+};
+
+Task Square(OffloadPool& pool, CompletionQueue& cq, int id, int& pending, Gate* gate) {
+  auto reactor = std::this_thread::get_id();
+  pending++;
+  auto r = co_await Offload(pool, cq, [id, gate]() {
+    if (gate) {
+      gate->started.count_down();
+      gate->release.wait();
+    }
+    return SlowSquare(id);
+  });
+  if (r) {
+    std::cout << "Task [" << id << "] result " << *r
+              << (std::this_thread::get_id() == reactor ? " on reactor\n" : " NOT on reactor\n");
+  } else {
+    std::cout << "Task [" << id << "] rejected: offload queue is full\n";
+  }
+  pending--;
+}
+
+int main() {
+  auto pool = OffloadPool(kWorkers, 4);
+  auto cq = CompletionQueue();
+  auto pending = 0;
+
+  auto epfd = epoll_create(1);
+  auto ev = epoll_event{};
+  ev.events = EPOLLIN;
+  ev.data.fd = cq.fd();
+  epoll_ctl(epfd, EPOLL_CTL_ADD, cq.fd(), &ev);
+  // 每50ms一次心跳，用来观察reactor在阻塞调用执行期间是否仍然可以响应
+  auto tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  auto interval = itimerspec{.it_interval = {0, 50'000'000}, .it_value = {0, 50'000'000}};
+  timerfd_settime(tfd, 0, &interval, nullptr);
+  ev.data.fd = tfd;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+
+  // 4个worker都在执行前4个任务，接下来的4个任务进入容量为4的队列，第9个及以后的任务会被拒绝
+  auto gate = Gate{};
+  for (auto i = 0; i < 10; i++) {
+    auto task = Square(pool, cq, i, pending, i < kWorkers ? &gate : nullptr);
+    task.handle.resume();
+    if (i == kWorkers - 1) {
+      gate.started.wait();
+    }
+  }
+  gate.release.count_down();
+
+  auto ticks = 0;
+  while (pending > 0) {
+    epoll_event events[8];
+    auto ne = epoll_wait(epfd, events, 8, -1);
+    for (auto i = 0; i < ne; i++) {
+      if (events[i].data.fd == cq.fd()) {
+        cq.Drain();
+      } else {
+        auto expirations = (uint64_t)0;
+        (void)!read(tfd, &expirations, sizeof(expirations));
+        ticks++;
+      }
+    }
+  }
+
+  auto stats = pool.stats();
+  std::cout << "heartbeats while waiting: " << ticks << '\n'
+            << "submitted " << stats.submitted << ", rejected " << stats.rejected << '\n'
+            << "queue latency mean " << stats.queue_latency->Mean().count()
+            << "us, p99 <= " << stats.queue_latency->Percentile(0.99).count()
+            << "us, max " << stats.queue_latency->Max().count() << "us\n"
+            << "run latency mean " << stats.run_latency->Mean().count()
+            << "us, p99 <= " << stats.run_latency->Percentile(0.99).count()
+            << "us, max " << stats.run_latency->Max().count() << "us\n";
+  (void)close(tfd);
+  (void)close(epfd);
+  return 0;
+}
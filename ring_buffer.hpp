@@ -0,0 +1,77 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+
+// Bounded byte ring with one producer and one consumer. Both sides hand out
+// contiguous spans so data can be read from / written to a socket in place:
+// the producer fills WritableSpan() and calls Commit(), the consumer drains
+// ReadableSpan() and calls Consume(). A span stays valid while the other side
+// keeps working, which lets a coroutine hold it across a suspension.
+//
+// Not thread safe: the producer and the consumer must run on the same thread,
+// e.g. two coroutines on one reactor.
+class RingBuffer {
+public:
+  // capacity must be a power of two
+  explicit RingBuffer(size_t capacity);
+
+  RingBuffer(const RingBuffer&) = delete;
+  RingBuffer& operator=(const RingBuffer&) = delete;
+
+  size_t capacity() const noexcept { return capacity_; }
+
+  size_t size() const noexcept { return head_ - tail_; }
+
+  bool empty() const noexcept { return head_ == tail_; }
+
+  bool full() const noexcept { return size() == capacity_; }
+
+  // Free space up to the end of the storage, empty if the ring is full
+  std::span<char> WritableSpan() noexcept;
+
+  void Commit(size_t n) noexcept;
+
+  // Buffered bytes up to the end of the storage, empty if the ring is empty
+  std::span<const char> ReadableSpan() const noexcept;
+
+  void Consume(size_t n) noexcept;
+
+private:
+  const size_t capacity_;
+  std::unique_ptr<char[]> data_;
+  // Bytes ever committed / consumed, the difference is the size
+  uint64_t head_{0};
+  uint64_t tail_{0};
+};
+
+inline RingBuffer::RingBuffer(size_t capacity)
+  : capacity_{capacity}, data_{std::make_unique_for_overwrite<char[]>(capacity)} {
+  assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+}
+
+inline std::span<char> RingBuffer::WritableSpan() noexcept {
+  auto offset = head_ & (capacity_ - 1);
+  auto n = std::min(capacity_ - size(), capacity_ - offset);
+  return {data_.get() + offset, n};
+}
+
+inline void RingBuffer::Commit(size_t n) noexcept {
+  assert(n <= capacity_ - size());
+  head_ += n;
+}
+
+inline std::span<const char> RingBuffer::ReadableSpan() const noexcept {
+  auto offset = tail_ & (capacity_ - 1);
+  auto n = std::min(size(), capacity_ - offset);
+  return {data_.get() + offset, n};
+}
+
+inline void RingBuffer::Consume(size_t n) noexcept {
+  assert(n <= size());
+  tail_ += n;
+}
@@ -6,6 +6,8 @@
 #include <coroutine>
 #include <utility>
 
+#include "trace.hpp"
+
 class task {
 public:
   task(task&& t) noexcept : coro_(std::exchange(t.coro_, {})) {}
@@ -35,10 +37,11 @@ public:
   struct awaiter {
     bool await_ready() const noexcept { return false; }
     auto await_suspend(std::coroutine_handle<> h) noexcept {
+      TRACE_SUSPEND(kTask, h.address());
       coro.promise().continuation = h;
       return coro;
     }
-    void await_resume() noexcept {}
+    void await_resume() noexcept { TRACE_RESUME(kTask, coro.promise().continuation.address()); }
 
     std::coroutine_handle<promise_type> coro;
   };
@@ -7,6 +7,9 @@
 #include <queue>
 #include <thread>
 
+#include "metrics.hpp"
+#include "trace.hpp"
+
 // Simple but non-performant timer
 class Timer {
 public:
@@ -76,9 +79,10 @@ inline void Timer::Run() {
       auto min_ev = events_.top();
       events_.pop();
       l.unlock();
+      metrics::Local().timer_heap_size.Add(-1);
       min_ev.fun();
     } else {
-      cv_.wait_for(l, now - min_tp);
+      cv_.wait_for(l, min_tp - now);
     }
   }
 }
@@ -89,7 +93,8 @@ inline void Timer::RunAfter(const std::chrono::duration<Rep, Period>& delay, Fun
   auto l = std::unique_lock(mtx_);
   auto ev = Event{.tp = tp, .fun = std::move(fun), .order = ++order_};
   events_.push(std::move(ev));
-  if (events_.top().order == order_ - 1) {
+  metrics::Local().timer_heap_size.Add(1);
+  if (events_.top().order == order_) {
     cv_.notify_one();
   }
 }
@@ -98,12 +103,26 @@ template <class Rep, class Period>
 inline auto operator co_await(const std::chrono::duration<Rep, Period>& rel_time) {
   struct awaiter {
     bool await_ready() const noexcept { return rel_time.count() <= 0; }
-    auto await_resume() noexcept {}
+    auto await_resume() noexcept {
+      if (suspended_at != metrics::Clock::time_point{}) {
+        metrics::OnResume(suspended_at);
+        TRACE_RESUME(kTimer, handle.address());
+      }
+    }
     void await_suspend(std::coroutine_handle<> h) {
+      suspended_at = metrics::OnSuspend(metrics::Reason::kTimer);
+#ifdef ENABLE_TRACE
+      handle = h;
+#endif
+      TRACE_SUSPEND(kTimer, h.address());
       Timer::Instance().RunAfter(rel_time, [h]() { h.resume(); });
     }
   
     std::chrono::duration<Rep, Period> rel_time;
+    metrics::Clock::time_point suspended_at{};
+#ifdef ENABLE_TRACE
+    std::coroutine_handle<> handle{};
+#endif
   };
   return awaiter{rel_time};
 }
@@ -0,0 +1,183 @@
+#pragma once
+
+// Suspend/resume timeline tracing. Build with -DENABLE_TRACE to record events,
+// otherwise the TRACE_* macros expand to nothing.
+//
+// Every thread appends fixed-size binary events to its own ring buffer, old
+// events are overwritten. trace::DumpChromeTrace() converts the events of a
+// recent time window into Chrome trace-event JSON (chrome://tracing, Perfetto):
+// one row per coroutine id showing when it was running and where it was parked.
+
+#ifdef ENABLE_TRACE
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace trace {
+
+// kStart (a resume) and kExit (a suspend) mark the first run and the end of a
+// coroutine instead of a place where it was parked
+enum class Reason : uint8_t { kRead, kWrite, kTimer, kTask, kRing, kStart, kExit };
+
+inline constexpr const char* kReasonNames[] = {"read", "write", "timer", "task", "ring", "start", "exit"};
+
+struct Event {
+  uint64_t ts_ns;
+  uint64_t id;
+  int32_t fd; // fd waited on, -1 if none
+  Reason reason;
+  bool suspend;
+};
+
+class Ring {
+public:
+  // Events kept per thread, must be a power of two
+  static constexpr size_t kCapacity = 1 << 16;
+
+  explicit Ring(uint32_t tid) : tid_{tid} {}
+
+  uint32_t tid() const noexcept { return tid_; }
+
+  // Owning thread only
+  void Push(const Event& e) noexcept {
+    auto head = head_.load(std::memory_order_relaxed);
+    // Pairs with the fence in Snapshot(): a reader that sees any part of this
+    // overwrite also sees head_ >= head
+    std::atomic_thread_fence(std::memory_order_release);
+    events_[head & (kCapacity - 1)] = e;
+    head_.store(head + 1, std::memory_order_release);
+  }
+
+  // Any thread. Events overwritten while copying are dropped.
+  std::vector<Event> Snapshot() const;
+
+private:
+  const uint32_t tid_;
+  std::atomic<uint64_t> head_{0};
+  std::array<Event, kCapacity> events_{};
+};
+
+inline std::vector<Event> Ring::Snapshot() const {
+  auto head = head_.load(std::memory_order_acquire);
+  auto begin = head > kCapacity ? head - kCapacity : 0;
+  auto out = std::vector<Event>{};
+  out.reserve(head - begin);
+  for (auto i = begin; i < head; i++) {
+    out.push_back(events_[i & (kCapacity - 1)]);
+  }
+  // The writer may have lapped the oldest entries during the copy. The fence
+  // keeps the copy from being reordered after the load below. Push()
+  // writes slot `head` before publishing head + 1, so the slot of
+  // lapped - kCapacity may be torn as well.
+  std::atomic_thread_fence(std::memory_order_acquire);
+  auto lapped = head_.load(std::memory_order_relaxed);
+  if (lapped >= begin + kCapacity) {
+    auto stale = std::min<uint64_t>(lapped - begin - kCapacity + 1, out.size());
+    out.erase(out.begin(), out.begin() + stale);
+  }
+  return out;
+}
+
+class Registry {
+public:
+  // Never destroyed, threads may still record events during exit
+  static Registry& Instance() {
+    static auto obj = new Registry();
+    return *obj;
+  }
+
+  Ring* NewRing(uint32_t tid) {
+    auto l = std::lock_guard(mtx_);
+    rings_.push_back(std::make_unique<Ring>(tid));
+    return rings_.back().get();
+  }
+
+  // Write the events of the last `window` as Chrome trace-event JSON
+  void DumpChromeTrace(std::ostream& out, std::chrono::nanoseconds window) const;
+
+private:
+  mutable std::mutex mtx_;
+  std::vector<std::unique_ptr<Ring>> rings_;
+};
+
+inline uint64_t Now() noexcept {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline void Registry::DumpChromeTrace(std::ostream& out, std::chrono::nanoseconds window) const {
+  auto now = Now();
+  auto since = now > (uint64_t)window.count() ? now - (uint64_t)window.count() : 0;
+  auto first = true;
+  auto pid = getpid();
+  // Rows are coroutine ids, the recording thread and the fd go into args
+  auto emit = [&](const char* name, char ph, const Event& e, uint32_t thread) {
+    out << (first ? "\n" : ",\n") << "{\"name\":\"" << name << "\",\"cat\":\"coro\",\"ph\":\"" << ph
+        << "\",\"ts\":" << e.ts_ns / 1000 << '.' << e.ts_ns % 1000 / 100
+        << ",\"pid\":" << pid << ",\"tid\":" << e.id << ",\"args\":{\"thread\":" << thread;
+    if (e.fd >= 0) {
+      out << ",\"fd\":" << e.fd;
+    }
+    out << "}}";
+    first = false;
+  };
+  out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+  auto l = std::lock_guard(mtx_);
+  for (auto& ring : rings_) {
+    for (auto& e : ring->Snapshot()) {
+      if (e.ts_ns < since) {
+        continue;
+      }
+      // A coroutine alternates between "running" and being parked on a reason
+      auto reason = kReasonNames[(size_t)e.reason];
+      if (e.reason == Reason::kStart) {
+        emit("running", 'B', e, ring->tid());
+      } else if (e.reason == Reason::kExit) {
+        // Closes "running", or the reason it was parked on if it was destroyed
+        emit("running", 'E', e, ring->tid());
+      } else if (e.suspend) {
+        emit("running", 'E', e, ring->tid());
+        emit(reason, 'B', e, ring->tid());
+      } else {
+        emit(reason, 'E', e, ring->tid());
+        emit("running", 'B', e, ring->tid());
+      }
+    }
+  }
+  out << "\n]}\n";
+}
+
+// Ring of the calling thread
+inline Ring& Local() {
+  thread_local auto ring = Registry::Instance().NewRing((uint32_t)syscall(SYS_gettid));
+  return *ring;
+}
+
+inline void Record(Reason reason, uint64_t id, int32_t fd, bool suspend) noexcept {
+  Local().Push(Event{.ts_ns = Now(), .id = id, .fd = fd, .reason = reason, .suspend = suspend});
+}
+
+} // namespace trace
+
+#define TRACE_SUSPEND(reason, id) ::trace::Record(::trace::Reason::reason, (uint64_t)(id), -1, true)
+#define TRACE_RESUME(reason, id) ::trace::Record(::trace::Reason::reason, (uint64_t)(id), -1, false)
+// Same for a coroutine waiting on an fd, the fd shows up in the event args
+#define TRACE_SUSPEND_FD(reason, id, fd) ::trace::Record(::trace::Reason::reason, (uint64_t)(id), (fd), true)
+#define TRACE_RESUME_FD(reason, id, fd) ::trace::Record(::trace::Reason::reason, (uint64_t)(id), (fd), false)
+
+#else
+
+#define TRACE_SUSPEND(reason, id) do {} while (0)
+#define TRACE_RESUME(reason, id) do {} while (0)
+#define TRACE_SUSPEND_FD(reason, id, fd) do {} while (0)
+#define TRACE_RESUME_FD(reason, id, fd) do {} while (0)
+
+#endif
@@ -0,0 +1,131 @@
+// udp_echo_server的压测客户端：对若干batch size分别用sendmmsg发出一批datagram，
+// 再用recvmmsg收回echo，统计每秒收到的回包数(pkt/s)
+//
+// 这里的batch size只是客户端一次突发的datagram数，服务端每次recvmmsg/sendmmsg的batch由它的-b决定，
+// 两边要分别扫描。服务端的socket缓冲区也要放得下一次突发(-r)，例如：
+//   for b in 1 4 16 64 256; do
+//     ./udp_echo_server -b $b -r 4194304 9000 & sleep 0.2
+//     ./udp_echo_bench 127.0.0.1 9000 1200 1; kill $!
+//   done
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/ip.h>
+#include <unistd.h>
+
+constexpr size_t kBatchSizes[] = {1, 4, 16, 64, 256};
+
+// 把socket缓冲区设置为至少bytes，否则一次突发超出默认缓冲区(约208KB)的部分会被内核丢弃，
+// 测出来的只是SO_RCVTIMEO的超时。超过net.core.[rw]mem_max时尝试*BUFFORCE(需要CAP_NET_ADMIN)
+void SetBuffer(int fd, int optname, int force_optname, int bytes) {
+  // 内核把设置的值翻倍，一半留给sk_buff等开销，getsockopt返回翻倍后的值
+  auto effective = 0;
+  auto len = (socklen_t)sizeof(effective);
+  if (setsockopt(fd, SOL_SOCKET, optname, &bytes, sizeof(bytes)) != 0 ||
+      getsockopt(fd, SOL_SOCKET, optname, &effective, &len) != 0) {
+    perror("setsockopt");
+    exit(EXIT_FAILURE);
+  }
+  if (effective / 2 < bytes && setsockopt(fd, SOL_SOCKET, force_optname, &bytes, sizeof(bytes)) != 0) {
+    std::cerr << "warning: socket buffer capped at " << effective << " byte(s), "
+              << "large batches may be dropped by the kernel\n";
+  }
+}
+
+struct Result {
+  uint64_t sent{0};
+  uint64_t received{0};
+  double seconds{0};
+};
+
+Result Run(int fd, size_t batch_size, size_t payload, std::chrono::milliseconds duration) {
+  using Clock = std::chrono::steady_clock;
+  auto slab = std::vector<char>(batch_size * payload, 'x');
+  auto iovs = std::vector<iovec>(batch_size);
+  auto msgs = std::vector<mmsghdr>(batch_size);
+  auto result = Result{};
+  auto start = Clock::now();
+  auto deadline = start + duration;
+  while (Clock::now() < deadline) {
+    for (auto i = (size_t)0; i < batch_size; i++) {
+      iovs[i] = iovec{.iov_base = slab.data() + i * payload, .iov_len = payload};
+      msgs[i] = mmsghdr{};
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    auto ns = sendmmsg(fd, msgs.data(), batch_size, 0);
+    if (ns < 0) {
+      perror("sendmmsg");
+      exit(EXIT_FAILURE);
+    }
+    result.sent += ns;
+    // 等待本批的回包，超时说明有丢包，直接进入下一批
+    auto pending = ns;
+    while (pending > 0) {
+      auto nr = recvmmsg(fd, msgs.data(), pending, MSG_WAITFORONE, nullptr);
+      if (nr < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          break;
+        }
+        perror("recvmmsg");
+        exit(EXIT_FAILURE);
+      }
+      result.received += nr;
+      pending -= nr;
+    }
+  }
+  result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  return result;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3 || argc > 5) {
+    std::cerr << "Usage: " << argv[0] << " host port [payload_bytes] [seconds_per_batch_size]\n";
+    return -1;
+  }
+  auto port = (uint16_t)atoi(argv[2]);
+  auto payload = argc > 3 ? (size_t)atoi(argv[3]) : (size_t)64;
+  auto seconds = argc > 4 ? atoi(argv[4]) : 2;
+  auto addr = sockaddr_in{.sin_family = AF_INET, .sin_port = htons(port)};
+  if (inet_pton(AF_INET, argv[1], &addr.sin_addr) != 1) {
+    std::cerr << "invalid address: " << argv[1] << '\n';
+    return -1;
+  }
+  auto fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (fd < 0) {
+    perror("socket");
+    exit(EXIT_FAILURE);
+  }
+  if (connect(fd, (const sockaddr*)&addr, sizeof(addr)) != 0) {
+    perror("connect");
+    exit(EXIT_FAILURE);
+  }
+  // 每个datagram在内核里还有sk_buff等约1KB的开销
+  auto max_batch = *std::max_element(std::begin(kBatchSizes), std::end(kBatchSizes));
+  auto buffer_bytes = (int)(max_batch * (payload + 1024));
+  SetBuffer(fd, SO_SNDBUF, SO_SNDBUFFORCE, buffer_bytes);
+  SetBuffer(fd, SO_RCVBUF, SO_RCVBUFFORCE, buffer_bytes);
+  auto timeout = timeval{.tv_sec = 0, .tv_usec = 100 * 1000};
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0) {
+    perror("setsockopt");
+    exit(EXIT_FAILURE);
+  }
+  std::cout << std::setw(8) << "batch" << std::setw(14) << "pkt/s" << std::setw(10) << "loss\n";
+  for (auto batch_size : kBatchSizes) {
+    auto r = Run(fd, batch_size, payload, std::chrono::seconds(seconds));
+    auto loss = r.sent ? 100.0 * (r.sent - r.received) / r.sent : 0.0;
+    std::cout << std::setw(8) << batch_size
+              << std::setw(14) << (uint64_t)(r.received / r.seconds)
+              << std::setw(8) << std::fixed << std::setprecision(2) << loss << "%\n";
+  }
+  (void)close(fd);
+  return 0;
+}
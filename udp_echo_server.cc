@@ -0,0 +1,355 @@
+// UDP版本的echo server：每次系统调用通过recvmmsg/sendmmsg收发一批datagram，
+// mmsghdr数组和收发缓冲区(slab)在连接协程创建时一次性分配，之后重复使用。
+//
+// 可选开启GRO/GSO(-g)：内核把同一条流的多个datagram合并成一个大buffer交给
+// recvmmsg，回写时通过UDP_SEGMENT按原来的段大小切分，进一步减少系统调用次数。
+#include <cassert>
+#include <climits>
+#include <cstring>
+#include <chrono>
+#include <coroutine>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+
+struct promise_type;
+
+using CoroutineHandle = std::coroutine_handle<promise_type>;
+
+struct Coroutine : public CoroutineHandle {
+  using promise_type = ::promise_type;
+};
+
+struct promise_type {
+  Coroutine get_return_object() { return (Coroutine)CoroutineHandle::from_promise(*this); }
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  std::suspend_always final_suspend() noexcept { return {}; }
+  void return_void() {}
+  void unhandled_exception() {}
+};
+
+void setsockopt_i(int fd, int level, int optname, int value) {
+  if (auto r = setsockopt(fd, level, optname, &value, 4); r != 0) {
+    perror("setsockopt");
+    exit(EXIT_FAILURE);
+  }
+}
+
+void epoll_ctl_ex(int epfd, int op, int fd, epoll_event* event) {
+  if (auto r = epoll_ctl(epfd, op, fd, event); r != 0) {
+    perror("epoll_ctl");
+    exit(EXIT_FAILURE);
+  }
+}
+
+bool WouldBlock(ssize_t ret) {
+  return ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// 一批datagram的收发缓冲区，所有内存在构造时分配
+struct Batch {
+  // 控制消息里只会出现UDP_GRO/UDP_SEGMENT，一个int足够
+  static constexpr size_t kControlSize = CMSG_SPACE(sizeof(int));
+
+  size_t slot_size;
+  std::vector<mmsghdr> msgs;
+  std::vector<iovec> iovs;
+  std::vector<sockaddr_in> addrs;
+  std::vector<char> control;
+  std::vector<char> slab;
+  // 第i个datagram被GRO合并时的段大小，0表示未合并
+  std::vector<uint16_t> segment_sizes;
+
+  Batch(size_t batch_size, size_t slot_size)
+    : slot_size(slot_size),
+      msgs(batch_size),
+      iovs(batch_size),
+      addrs(batch_size),
+      control(batch_size * kControlSize),
+      slab(batch_size * slot_size),
+      segment_sizes(batch_size) {}
+
+  size_t size() const { return msgs.size(); }
+
+  // recvmmsg之前重置每个mmsghdr
+  void PrepareRecv() {
+    for (auto i = (size_t)0; i < size(); i++) {
+      iovs[i] = iovec{.iov_base = slab.data() + i * slot_size, .iov_len = slot_size};
+      msgs[i].msg_hdr = msghdr{
+        .msg_name = &addrs[i],
+        .msg_namelen = sizeof(addrs[i]),
+        .msg_iov = &iovs[i],
+        .msg_iovlen = 1,
+        .msg_control = control.data() + i * kControlSize,
+        .msg_controllen = kControlSize,
+      };
+      msgs[i].msg_len = 0;
+    }
+  }
+
+  // 把收到的n个datagram原样作为回包，msg_name里已经是对端地址。
+  // 比slot_size大而被截断(MSG_TRUNC)的datagram不回显，其余的移到msgs前部，返回回包个数
+  size_t PrepareSend(size_t n) {
+    auto kept = (size_t)0;
+    for (auto i = (size_t)0; i < n; i++) {
+      auto& hdr = msgs[i].msg_hdr;
+      if (hdr.msg_flags & MSG_TRUNC) {
+        continue;
+      }
+      auto segment_size = (uint16_t)0;
+#ifdef UDP_GRO
+      for (auto c = CMSG_FIRSTHDR(&hdr); c != nullptr; c = CMSG_NXTHDR(&hdr, c)) {
+        if (c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO) {
+          auto gso_size = 0;
+          memcpy(&gso_size, CMSG_DATA(c), sizeof(gso_size));
+          segment_size = (uint16_t)gso_size;
+        }
+      }
+#endif
+      iovs[i].iov_len = msgs[i].msg_len;
+      hdr.msg_control = nullptr;
+      hdr.msg_controllen = 0;
+#ifdef UDP_SEGMENT
+      if (segment_size != 0 && msgs[i].msg_len > segment_size) {
+        hdr.msg_control = control.data() + i * kControlSize;
+        hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+        auto c = CMSG_FIRSTHDR(&hdr);
+        c->cmsg_level = SOL_UDP;
+        c->cmsg_type = UDP_SEGMENT;
+        c->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        memcpy(CMSG_DATA(c), &segment_size, sizeof(uint16_t));
+      }
+#endif
+      // mmsghdr里都是指针，移动后仍然指向第i个datagram的缓冲区
+      segment_sizes[kept] = segment_size;
+      msgs[kept++] = msgs[i];
+    }
+    return kept;
+  }
+
+  // 一个datagram(可能是GRO合并后的)包含的报文个数
+  size_t Packets(size_t i) const {
+    auto seg = segment_sizes[i];
+    auto len = msgs[i].msg_len;
+    return seg == 0 ? 1 : (len + seg - 1) / seg;
+  }
+};
+
+struct RecvBatchAwaiter {
+  bool ready;
+  int ret;
+  int fd;
+  Batch* batch;
+
+  bool await_ready() const noexcept { return ready; }
+
+  void await_suspend(std::coroutine_handle<>) {
+    assert(!ready);
+  }
+
+  int await_resume() {
+    if (!ready) {
+      ret = recvmmsg(fd, batch->msgs.data(), batch->size(), MSG_DONTWAIT, nullptr);
+    }
+    return ret;
+  }
+};
+
+// 尝试收取一批datagram，没有数据可读时挂起等待EPOLLIN
+RecvBatchAwaiter RecvBatch(int fd, Batch& batch) {
+  batch.PrepareRecv();
+  auto ret = recvmmsg(fd, batch.msgs.data(), batch.size(), MSG_DONTWAIT, nullptr);
+  return RecvBatchAwaiter{.ready = !WouldBlock(ret), .ret = ret, .fd = fd, .batch = &batch};
+}
+
+struct SendBatchAwaiter {
+  bool ready;
+  int ret;
+  int epfd;
+  int fd;
+  mmsghdr* msgs;
+  unsigned int n;
+  void* handle_address;
+
+  bool await_ready() const noexcept { return ready; }
+
+  void await_suspend(std::coroutine_handle<> handle) {
+    assert(!ready);
+    handle_address = handle.address();
+    // 只等待EPOLLOUT，否则收到新的datagram也会唤醒发送方，此时sendmmsg仍然返回EAGAIN
+    auto ev = epoll_event{};
+    ev.events = EPOLLOUT;
+    ev.data.ptr = handle.address();
+    epoll_ctl_ex(epfd, EPOLL_CTL_MOD, fd, &ev);
+  }
+
+  int await_resume() {
+    if (!ready) {
+      auto ev = epoll_event{};
+      ev.events = EPOLLIN;
+      ev.data.ptr = handle_address;
+      epoll_ctl_ex(epfd, EPOLL_CTL_MOD, fd, &ev);
+      ret = sendmmsg(fd, msgs, n, MSG_DONTWAIT);
+    }
+    return ret;
+  }
+};
+
+// 发送msgs[0, n)，可能只发送了一部分，返回值为发送成功的datagram个数
+SendBatchAwaiter SendBatch(int epfd, int fd, mmsghdr* msgs, unsigned int n) {
+  auto ret = sendmmsg(fd, msgs, n, MSG_DONTWAIT);
+  return SendBatchAwaiter{.ready = !WouldBlock(ret), .ret = ret, .epfd = epfd, .fd = fd, .msgs = msgs, .n = n};
+}
+
+struct Stats {
+  using Clock = std::chrono::steady_clock;
+
+  uint64_t packets{0};
+  uint64_t datagrams{0};
+  uint64_t syscalls{0};
+  uint64_t truncated{0};
+  Clock::time_point since{Clock::now()};
+
+  // 每秒输出一次吞吐
+  void MaybeReport() {
+    auto now = Clock::now();
+    auto elapsed = std::chrono::duration<double>(now - since).count();
+    if (elapsed < 1.0) {
+      return;
+    }
+    std::cout << "rx " << (uint64_t)(packets / elapsed) << " pkt/s, "
+              << (uint64_t)(datagrams / elapsed) << " dgram/s, "
+              << (syscalls ? (double)datagrams / syscalls : 0.0) << " dgram/recvmmsg";
+    if (truncated) {
+      std::cout << ", " << truncated << " truncated datagram(s) dropped";
+    }
+    std::cout << '\n';
+    *this = Stats{};
+  }
+};
+
+Coroutine HandleDatagrams(int epfd, int fd, size_t batch_size, size_t slot_size) {
+  auto batch = Batch(batch_size, slot_size);
+  auto stats = Stats{};
+  while (true) {
+    auto nr = co_await RecvBatch(fd, batch);
+    if (nr < 0) {
+      std::cerr << "[" << fd << "] recvmmsg failed: " << strerror(errno) << '\n';
+      break;
+    }
+    auto ns = (int)batch.PrepareSend(nr);
+    stats.syscalls++;
+    stats.datagrams += nr;
+    stats.truncated += nr - ns;
+    for (auto i = 0; i < ns; i++) {
+      stats.packets += batch.Packets(i);
+    }
+    auto sent = 0;
+    while (sent < ns) {
+      auto r = co_await SendBatch(epfd, fd, batch.msgs.data() + sent, ns - sent);
+      if (WouldBlock(r)) {
+        continue;
+      }
+      if (r < 0) {
+        // UDP不保证送达，发送失败(例如ECONNREFUSED、ENOBUFS)时丢弃本批剩余的回包
+        std::cerr << "[" << fd << "] sendmmsg failed: " << strerror(errno) << '\n';
+        break;
+      }
+      sent += r;
+    }
+    stats.MaybeReport();
+  }
+  epoll_ctl_ex(epfd, EPOLL_CTL_DEL, fd, nullptr);
+  (void)close(fd);
+}
+
+int main(int argc, char** argv) {
+  auto batch_size = (size_t)64;
+  auto gro = false;
+  auto buffer_bytes = 0;
+  auto opt = 0;
+  while ((opt = getopt(argc, argv, "b:gr:")) != -1) {
+    switch (opt) {
+      case 'b': batch_size = (size_t)atoi(optarg); break;
+      case 'g': gro = true; break;
+      case 'r': buffer_bytes = atoi(optarg); break;
+      default: goto usage;
+    }
+  }
+  if (optind + 1 != argc || batch_size == 0 || batch_size > IOV_MAX || buffer_bytes < 0) {
+usage:
+    std::cerr << "Usage: " << argv[0] << " [-b batch_size] [-g] [-r socket_buffer_bytes] port\n"
+              << "  -b  datagrams per recvmmsg/sendmmsg (1-" << IOV_MAX << ", default 64)\n"
+              << "  -g  enable UDP GRO/GSO segmentation offload\n"
+              << "  -r  SO_RCVBUF/SO_SNDBUF, large enough for the bursts of the client\n"
+              << "      (default: the kernel default, capped by net.core.[rw]mem_max)\n";
+    return -1;
+  }
+  auto port = (uint16_t)atoi(argv[optind]);
+  auto fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+  if (fd < 0) {
+    perror("socket");
+    exit(EXIT_FAILURE);
+  }
+  setsockopt_i(fd, SOL_SOCKET, SO_REUSEADDR, 1);
+  if (buffer_bytes > 0) {
+    setsockopt_i(fd, SOL_SOCKET, SO_RCVBUF, buffer_bytes);
+    setsockopt_i(fd, SOL_SOCKET, SO_SNDBUF, buffer_bytes);
+  }
+  // GRO合并后单个datagram最大64KB，否则按以太网MTU分配即可
+  auto slot_size = (size_t)2048;
+  if (gro) {
+#ifdef UDP_GRO
+    setsockopt_i(fd, SOL_UDP, UDP_GRO, 1);
+    slot_size = 65536;
+#else
+    std::cerr << "UDP GRO is not supported on this platform\n";
+    return -1;
+#endif
+  }
+  auto bindaddr = sockaddr_in {
+    .sin_family = AF_INET,
+    .sin_port = htons(port),
+    .sin_addr = {
+      .s_addr = htonl(INADDR_ANY)
+    }
+  };
+  if (auto r = bind(fd, (const sockaddr*)&bindaddr, sizeof(bindaddr)); r != 0) {
+    perror("bind");
+    exit(EXIT_FAILURE);
+  }
+  std::cout << "listening on udp port " << port << ", batch size " << batch_size
+            << (gro ? ", GRO/GSO enabled" : "") << '\n';
+  auto epfd = epoll_create(1);
+  auto coro = HandleDatagrams(epfd, fd, batch_size, slot_size);
+  auto ev = epoll_event{};
+  ev.events = EPOLLIN;
+  ev.data.ptr = coro.address();
+  epoll_ctl_ex(epfd, EPOLL_CTL_ADD, fd, &ev);
+  coro.resume();
+  epoll_event events[16];
+  while (!coro.done()) {
+    auto ne = epoll_wait(epfd, events, sizeof(events)/sizeof(events[0]), -1);
+    if (ne == -1) {
+      perror("epoll_wait");
+      exit(EXIT_FAILURE);
+    }
+    for (auto i = 0; i < ne; i++) {
+      auto handle = std::coroutine_handle<>::from_address(events[i].data.ptr);
+      handle.resume();
+    }
+  }
+  coro.destroy();
+  return 0;
+}